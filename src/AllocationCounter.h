@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Count of heap allocations through operator new, to check that steady-state LM iterations
+// don't allocate (see Subdiv3D_Functor::allocations).  Counting replaces the global operator
+// new, so the program must opt in: define COUNT_ALLOCATIONS before including this header in
+// exactly one translation unit, as the COUNT_ALLOCATIONS CMake option (off by default) does for
+// bench.cpp.  Otherwise the count stays 0.
+//
+// Eigen's matrices allocate through malloc rather than operator new.  To check those, build with
+// EIGEN_RUNTIME_NO_MALLOC and bracket the code with Eigen::internal::set_is_malloc_allowed.
+inline std::atomic<long long>& allocation_count()
+{
+  static std::atomic<long long> count(0);
+  return count;
+}
+
+#ifdef COUNT_ALLOCATIONS
+void* operator new(size_t size)
+{
+  ++allocation_count();
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+void operator delete[](void* p) noexcept
+{
+  std::free(p);
+}
+#endif
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "Subdiv3D_Functor.h"
+#include "parallel.h"
+
+// Fit many independent (topology, point cloud, initial cage) jobs in-process, on a work-stealing
+// pool of threads.  Each topology is added once and its SubdivTopology is shared by all the jobs
+// on it; every job gets its own functor, so its own evaluation buffer and workspaces (S, dSdu,
+// dSdv, triplets).
+struct BatchFitter {
+  typedef Subdiv3D_Functor Functor;
+
+  struct Job {
+    int topology;               // As returned by add_topology
+    Matrix3X data_points;
+    Matrix3X control_vertices;  // Initial cage
+  };
+
+  struct Result {
+    Functor::InputType params;
+    Scalar fnorm;
+    Eigen::LevenbergMarquardtSpace::Status status;
+    double seconds;             // Latency of the job itself
+    double finished;            // Seconds from the start of the batch to the end of the job
+    int thread;
+  };
+
+  BatchFitter() :
+    num_threads(default_num_threads()),
+    maxfev(40),
+    wall_seconds(0),
+    steals(0)
+  {
+  }
+
+  int add_topology(MeshTopology const& mesh)
+  {
+    topologies.push_back(SubdivTopology::get(mesh));
+    return int(topologies.size()) - 1;
+  }
+
+  void fit(std::vector<Job> const& jobs, std::vector<Result>* results)
+  {
+    typedef std::chrono::steady_clock clock;
+    clock::time_point batch_start = clock::now();
+
+    results->resize(jobs.size());
+    steals = parallel_for_stealing(int(jobs.size()), num_threads, [&](int i, int thread) {
+      clock::time_point start = clock::now();
+      Job const& job = jobs[i];
+      Result& result = (*results)[i];
+
+      Functor functor(job.data_points, SubdivEvaluator(topologies[job.topology]));
+      functor.verbose = false;
+      functor.qr_threads = 1;   // The jobs already keep every thread busy
+
+      result.params.control_vertices = job.control_vertices;
+      result.params.us.resize(job.data_points.cols());
+      init_correspondences(functor.evaluator, job.control_vertices, job.data_points, &result.params.us);
+
+      Eigen::LevenbergMarquardt<Functor> lm(functor);
+      lm.setMaxfev(maxfev);
+      result.status = lm.minimize(result.params);
+      result.fnorm = lm.fnorm();
+
+      clock::time_point end = clock::now();
+      result.seconds = std::chrono::duration<double>(end - start).count();
+      result.finished = std::chrono::duration<double>(end - batch_start).count();
+      result.thread = thread;
+    });
+    wall_seconds = std::chrono::duration<double>(clock::now() - batch_start).count();
+  }
+
+  // Throughput and per-job latency of the last fit
+  void report(std::vector<Result> const& results, std::ostream& out) const
+  {
+    double total = 0, worst = 0;
+    for (auto const& r : results) {
+      total += r.seconds;
+      worst = std::max(worst, r.seconds);
+    }
+    size_t n = results.size();
+    out << "BatchFitter: " << n << " jobs on " << num_threads << " threads in " << wall_seconds << "s, "
+      << n / wall_seconds << " jobs/s; latency mean " << (n ? total / n : 0) << "s, max " << worst << "s; "
+      << steals << " steals\n";
+  }
+
+  // Options
+  int num_threads;
+  int maxfev;
+
+  // Stats of the last fit
+  double wall_seconds;
+  int steals;
+
+private:
+  std::vector<std::shared_ptr<SubdivTopology const> > topologies;
+};
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "Subdiv3D_Functor.h"
+
+// The state of a fit, enough to resume it later or on another machine: the parameters, and
+// LM's damping, i.e. its parameter scaling, trust region radius and parameter.
+struct FitSnapshot {
+  Subdiv3D_Functor::InputType params;
+  uint64_t topology_hash;   // SubdivTopology::hash of the mesh being fitted
+  VectorX diag;             // LM's scaling, empty before the first step
+  bool external_scaling;    // Whether diag was given to LM, or LM took it from the Jacobian
+  Scalar delta;             // LM's trust region radius at its last step, 0 before the first step
+  Scalar par;               // LM's parameter after its last step
+  Scalar fnorm;
+  int iterations;
+
+  FitSnapshot() : topology_hash(0), external_scaling(false), delta(0), par(0), fnorm(0), iterations(0) {}
+
+  // Native byte order: a header, then the control vertices, faces, uvs and diag as flat arrays.
+  // load returns false if the file is missing, has another version, doesn't match its size or
+  // isn't for topology.
+  static const uint32_t version = 2;
+  bool save(std::string const& filename) const;
+  bool load(std::string const& filename, SubdivTopology const& topology);
+
+private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t topology_hash;
+    uint64_t num_vertices;
+    uint64_t num_points;
+    uint64_t diag_size;
+    uint32_t scalar_size;
+    int32_t iterations;
+    uint32_t external_scaling;
+    double delta;
+    double par;
+    double fnorm;
+  };
+  static char const* magic() { return "OSDFITSN"; }
+  static uint32_t byte_order_mark() { return 0x01020304; }
+};
+
+inline bool FitSnapshot::save(std::string const& filename) const
+{
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, magic(), sizeof(header.magic));
+  header.version = version;
+  header.byte_order = byte_order_mark();
+  header.topology_hash = topology_hash;
+  header.num_vertices = params.control_vertices.cols();
+  header.num_points = params.us.size();
+  header.diag_size = diag.size();
+  header.scalar_size = sizeof(Scalar);
+  header.iterations = iterations;
+  header.external_scaling = external_scaling;
+  header.delta = delta;
+  header.par = par;
+  header.fnorm = fnorm;
+
+  std::vector<int32_t> faces(params.us.size());
+  Matrix2X uvs(2, params.us.size());
+  for (size_t i = 0; i < params.us.size(); ++i) {
+    faces[i] = params.us[i].face;
+    uvs.col(i) = params.us[i].u;
+  }
+
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  out.write((char const*)&header, sizeof(header));
+  out.write((char const*)params.control_vertices.data(), params.control_vertices.size() * sizeof(Scalar));
+  out.write((char const*)faces.data(), faces.size() * sizeof(int32_t));
+  out.write((char const*)uvs.data(), uvs.size() * sizeof(Scalar));
+  out.write((char const*)diag.data(), diag.size() * sizeof(Scalar));
+  return bool(out);
+}
+
+inline bool FitSnapshot::load(std::string const& filename, SubdivTopology const& topology)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary | std::ios::ate);
+  uint64_t file_size = uint64_t(std::streamoff(in.tellg()));
+  in.seekg(0);
+  Header header;
+  if (!in.read((char*)&header, sizeof(header)) ||
+      memcmp(header.magic, magic(), sizeof(header.magic)) != 0 ||
+      header.version != version ||
+      header.byte_order != byte_order_mark() ||
+      header.scalar_size != sizeof(Scalar) ||
+      header.topology_hash != topology.hash ||
+      header.num_vertices != uint64_t(topology.nVertices))
+    return false;
+
+  // The sizes, before allocating for them: num_points is bounded by what the file holds
+  uint64_t num_parameters = 3 * header.num_vertices + 2 * header.num_points;
+  if (header.num_points > file_size / (sizeof(int32_t) + 2 * sizeof(Scalar)) ||
+      (header.diag_size != 0 && header.diag_size != num_parameters) ||
+      file_size != sizeof(header) + (3 * header.num_vertices + header.diag_size) * sizeof(Scalar) +
+        header.num_points * (sizeof(int32_t) + 2 * sizeof(Scalar)))
+    return false;
+
+  std::vector<int32_t> faces(header.num_points);
+  Matrix2X uvs(2, header.num_points);
+  params.control_vertices.resize(3, header.num_vertices);
+  diag.resize(header.diag_size);
+  in.read((char*)params.control_vertices.data(), params.control_vertices.size() * sizeof(Scalar));
+  in.read((char*)faces.data(), faces.size() * sizeof(int32_t));
+  in.read((char*)uvs.data(), uvs.size() * sizeof(Scalar));
+  in.read((char*)diag.data(), diag.size() * sizeof(Scalar));
+  if (!in)
+    return false;
+  for (int32_t face : faces)
+    if (face < 0 || size_t(face) >= topology.mesh.num_faces())
+      return false;
+
+  params.us.resize(header.num_points);
+  for (size_t i = 0; i < params.us.size(); ++i)
+    params.us[i] = { faces[i], uvs.col(i) };
+  topology_hash = header.topology_hash;
+  iterations = header.iterations;
+  external_scaling = header.external_scaling != 0;
+  delta = Scalar(header.delta);
+  par = Scalar(header.par);
+  fnorm = Scalar(header.fnorm);
+  return true;
+}
+
+// Fit to a wall-clock budget rather than a number of iterations, whose cost varies wildly with
+// the mesh and data size.  LM steps are taken until the deadline, convergence or maxfev; as LM
+// only accepts steps that lower the error, the parameters it stops at are the best so far.  A
+// step isn't started unless the previous one suggests it will finish before the deadline.
+//
+// snapshot() records where the fit stopped, and resume() carries on from it, with LM's damping as
+// it was: its scaling, fixed if it was given to LM, and its trust region radius and parameter,
+// which LM doesn't expose but its lmpar2 records in the functor's qr_workspace.  With LM's own
+// scaling, LM takes it afresh from the Jacobian on the first resumed step, so the radius is
+// restored as closely as the snapshot's scaling matches that.
+struct DeadlineFitter {
+  typedef Subdiv3D_Functor Functor;
+  typedef std::chrono::steady_clock clock;
+
+  DeadlineFitter(Functor& functor) :
+    functor(functor),
+    maxfev(1000),
+    verbose(true),
+    iterations(0),
+    fnorm(0),
+    seconds(0),
+    out_of_time(false),
+    external_scaling(false),
+    delta(0),
+    par(0)
+  {
+  }
+
+  // Returns UserAsked if stopped by the deadline
+  Eigen::LevenbergMarquardtSpace::Status fit(Functor::InputType* params, double budget_seconds)
+  {
+    iterations = 0;
+    diag = scaling;
+    external_scaling = scaling.size() > 0;
+    delta = 0;
+    par = 0;
+    return run(params, budget_seconds);
+  }
+
+  // Returns ImproperInputParameters, leaving params alone, if the snapshot isn't of a fit of this
+  // functor's topology and number of points
+  Eigen::LevenbergMarquardtSpace::Status resume(FitSnapshot const& snapshot, Functor::InputType* params, double budget_seconds)
+  {
+    if (snapshot.topology_hash != functor.evaluator.topology->hash ||
+        snapshot.params.control_vertices.cols() != Index(functor.evaluator.topology->nVertices) ||
+        snapshot.params.us.size() != size_t(functor.data_points.cols()) ||
+        (snapshot.diag.size() != 0 && snapshot.diag.size() != functor.inputs()))
+      return Eigen::LevenbergMarquardtSpace::ImproperInputParameters;
+    *params = snapshot.params;
+    iterations = snapshot.iterations;
+    diag = snapshot.diag;
+    external_scaling = snapshot.external_scaling && diag.size() > 0;
+    delta = snapshot.delta;
+    par = snapshot.par;
+    return run(params, budget_seconds);
+  }
+
+  FitSnapshot snapshot(Functor::InputType const& params) const
+  {
+    FitSnapshot s;
+    s.params = params;
+    s.topology_hash = functor.evaluator.topology->hash;
+    s.diag = diag;
+    s.external_scaling = external_scaling;
+    s.delta = delta;
+    s.par = par;
+    s.fnorm = fnorm;
+    s.iterations = iterations;
+    return s;
+  }
+
+  Functor& functor;
+
+  // Options
+  int maxfev;           // Function evaluations per run, in case the budget is generous
+  bool verbose;
+  VectorX scaling;      // If set, LM's parameter scaling, fixed; else LM's own, from the Jacobian
+
+  // State and stats of the last run, cumulative over resumes
+  int iterations;
+  Scalar fnorm;
+  double seconds;       // Of the last run
+  bool out_of_time;
+
+private:
+  // LM's damping after the last step (see FitSnapshot)
+  VectorX diag;
+  bool external_scaling;
+  Scalar delta;
+  Scalar par;
+
+  Eigen::LevenbergMarquardtSpace::Status run(Functor::InputType* params, double budget_seconds)
+  {
+    using namespace Eigen::LevenbergMarquardtSpace;
+    clock::time_point start = clock::now();
+    clock::time_point deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(budget_seconds));
+    out_of_time = false;
+
+    Eigen::LevenbergMarquardt<Functor> lm(functor);
+    lm.setMaxfev(maxfev);
+    if (external_scaling) {
+      lm.setExternalScaling(true);
+      lm.diag() = diag;
+    }
+    // LM's first step bound is factor * |diag .* x|
+    if (delta > 0 && diag.size() > 0) {
+      Scalar xnorm = functor.estimateNorm(*params, diag);
+      if (xnorm > 0)
+        lm.setFactor(delta / xnorm);
+    }
+    Functor::QRSolver::Workspace& damping = functor.qr_workspace;
+    damping.lm_resume_par = par;
+
+    Status status = lm.minimizeInit(*params);
+    fnorm = lm.fnorm();
+    clock::duration last_step = clock::duration::zero();
+    while (status == NotStarted || status == Running) {
+      clock::time_point step_start = clock::now();
+      if (step_start + last_step > deadline) {
+        out_of_time = true;
+        status = UserAsked;
+        break;
+      }
+      damping.lm_delta = 0;
+      status = lm.minimizeOneStep(*params);
+      last_step = clock::now() - step_start;
+
+      ++iterations;
+      fnorm = lm.fnorm();
+      diag = lm.diag();
+      par = lm.lm_param();
+      // Unless the step stopped before choosing one, as on a small gradient
+      if (damping.lm_delta > 0)
+        delta = damping.lm_delta;
+    }
+    damping.lm_resume_par = 0;
+
+    seconds = std::chrono::duration<double>(clock::now() - start).count();
+    if (verbose)
+      std::cerr << "DeadlineFitter: " << iterations << " iterations, err = " << fnorm << ", " << seconds << "s of "
+        << budget_seconds << (out_of_time ? "s, out of time\n" : "s\n");
+    return status;
+  }
+};
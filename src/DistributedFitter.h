@@ -0,0 +1,538 @@
+#pragma once
+
+// Needs fork and sockets
+#ifndef _WIN32
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <Eigen/SparseCholesky>
+
+#include "Subdiv3D_Functor.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0    // E.g. macOS, where DistributedFitter sets SO_NOSIGPIPE instead
+#endif
+
+// A blocking connection to another process over a stream socket.  Values are sent in native
+// byte order, so both ends must be the same build.  A write to a closed connection fails rather
+// than raising SIGPIPE, so a lost peer shows as an error.  Reads check sizes from the wire
+// against those expected before allocating.
+struct Channel {
+  int fd;
+
+  explicit Channel(int fd = -1) : fd(fd) {}
+
+  bool write_bytes(void const* data, size_t n)
+  {
+    char const* p = (char const*)data;
+    while (n > 0) {
+      ssize_t k = ::send(fd, p, n, MSG_NOSIGNAL);
+      if (k < 0 && errno == EINTR)
+        continue;
+      if (k <= 0)
+        return false;
+      p += k;
+      n -= size_t(k);
+    }
+    return true;
+  }
+  bool read_bytes(void* data, size_t n)
+  {
+    char* p = (char*)data;
+    while (n > 0) {
+      ssize_t k = ::read(fd, p, n);
+      if (k < 0 && errno == EINTR)
+        continue;
+      if (k <= 0)
+        return false;
+      p += k;
+      n -= size_t(k);
+    }
+    return true;
+  }
+
+  template <typename T>
+  bool write(T const& value) { return write_bytes(&value, sizeof(T)); }
+  template <typename T>
+  bool read(T* value) { return read_bytes(value, sizeof(T)); }
+
+  // Dense matrices as rows, cols, then the coefficients
+  template <typename Derived>
+  bool write_matrix(Eigen::PlainObjectBase<Derived> const& m)
+  {
+    return write(int64_t(m.rows())) && write(int64_t(m.cols())) &&
+      write_bytes(m.data(), m.size() * sizeof(typename Derived::Scalar));
+  }
+  template <typename Derived>
+  bool read_matrix(Eigen::PlainObjectBase<Derived>* m, int64_t expected_rows, int64_t expected_cols)
+  {
+    int64_t rows, cols;
+    if (!read(&rows) || !read(&cols) || rows != expected_rows || cols != expected_cols)
+      return false;
+    m->resize(rows, cols);
+    return read_bytes(m->data(), m->size() * sizeof(typename Derived::Scalar));
+  }
+
+  // Sparse matrices in compressed form
+  template <typename T, int _Options, typename _Index>
+  bool write_sparse(Eigen::SparseMatrix<T, _Options, _Index> const& m)
+  {
+    assert(m.isCompressed());
+    return write(int64_t(m.rows())) && write(int64_t(m.cols())) && write(int64_t(m.nonZeros())) &&
+      write_bytes(m.outerIndexPtr(), (m.outerSize() + 1) * sizeof(_Index)) &&
+      write_bytes(m.innerIndexPtr(), m.nonZeros() * sizeof(_Index)) &&
+      write_bytes(m.valuePtr(), m.nonZeros() * sizeof(T));
+  }
+  template <typename T, int _Options, typename _Index>
+  bool read_sparse(Eigen::SparseMatrix<T, _Options, _Index>* m, int64_t expected_rows, int64_t expected_cols)
+  {
+    int64_t rows, cols, nnz;
+    if (!read(&rows) || !read(&cols) || !read(&nnz) || rows != expected_rows || cols != expected_cols ||
+        nnz < 0 || nnz > rows * cols)
+      return false;
+    m->resize(rows, cols);
+    m->resizeNonZeros(nnz);
+    if (!read_bytes(m->outerIndexPtr(), (m->outerSize() + 1) * sizeof(_Index)) ||
+        !read_bytes(m->innerIndexPtr(), nnz * sizeof(_Index)) ||
+        !read_bytes(m->valuePtr(), nnz * sizeof(T)))
+      return false;
+    // The structure, so a bad one can't index out of bounds
+    _Index const* outer = m->outerIndexPtr();
+    _Index const* inner = m->innerIndexPtr();
+    if (outer[0] != 0 || outer[m->outerSize()] != nnz)
+      return false;
+    for (Eigen::Index j = 0; j < m->outerSize(); ++j) {
+      if (outer[j + 1] < outer[j])
+        return false;
+      for (_Index k = outer[j]; k < outer[j + 1]; ++k)
+        if (inner[k] < 0 || inner[k] >= m->innerSize() || (k > outer[j] && inner[k] <= inner[k - 1]))
+          return false;
+    }
+    return true;
+  }
+};
+
+// Fit with the data points split between worker processes, for point clouds whose Jacobian
+// doesn't fit on one machine.  Each worker owns the points of one region of the cage (see
+// partition) and, per step, linearizes them and eliminates their correspondences, as
+// SchurlikeQRSolver separates the 3x2 blocks.  Only what remains, its part of the reduced
+// system in the control vertices, goes to the coordinator: for the damped normal equations
+//   [H1 + D1   C] [du]     [g1]
+//   [C^T  H2 + D2] [dX] = - [g2]
+// with H1 block diagonal (2x2 per point), the reduced system is
+//   (H2 - C^T (H1 + D1)^-1 C + D2) dX = -(g2 - C^T (H1 + D1)^-1 g1)
+// whose terms are sums over the points, so over the workers.  The coordinator adds them up,
+// solves for dX by sparse Cholesky and broadcasts it; each worker recovers its points' du and
+// takes the step.  Damping is Marquardt's, D = lambda diag(J^T J), accepting steps that lower
+// the error.
+//
+// Workers are forked processes talking over socketpairs, so the fit can be run (and checked
+// against a single process fit) on one machine.  Channel works over any stream socket, e.g. TCP
+// to workers on other machines, which would load their partition rather than inherit it.
+struct DistributedFitter {
+  typedef Subdiv3D_Functor Functor;
+  typedef Functor::JacobianType JacobianType;
+
+  enum Command : int32_t { CMD_COST, CMD_REDUCE, CMD_STEP, CMD_ACCEPT, CMD_REJECT, CMD_GATHER, CMD_QUIT };
+
+  DistributedFitter(SubdivEvaluator const& evaluator) :
+    evaluator(evaluator),
+    num_workers(4),
+    max_iterations(50),
+    initial_lambda(1e-3f),
+    tolerance(1e-8f),
+    verbose(true),
+    iterations(0),
+    fnorm(0),
+    bytes_received(0)
+  {
+  }
+
+  Eigen::LevenbergMarquardtSpace::Status fit(Matrix3X const& data_points, Functor::InputType* params);
+
+  // Points by worker: the cage's faces sorted by centroid along the longest side of the cage's
+  // bounding box, and cut into runs holding about equal numbers of points.  A worker's points
+  // then lie in one region, and its part of the reduced system involves few control vertices.
+  std::vector<std::vector<int> > partition(Functor::InputType const& params) const;
+
+  SubdivEvaluator evaluator;
+
+  // Options
+  int num_workers;
+  int max_iterations;
+  Scalar initial_lambda;
+  Scalar tolerance;         // Stop when a step lowers the error by less than this, relatively
+  bool verbose;
+
+  // Stats of the last fit
+  int iterations;
+  Scalar fnorm;
+  size_t bytes_received;    // By the coordinator, over the fit
+
+  // One worker's end: its points, and the state of the step being tried
+  struct Worker {
+    Functor functor;
+    Functor::InputType params;
+    Functor::InputType saved;
+    VectorX fvec;
+    JacobianType J;
+    bool linearized;
+    // From the last reduce, for the step's du = -(H1 + D1)^-1 (g1 + C dX)
+    JacobianType Minv_C;
+    VectorX Minv_g1;
+
+    Worker(Matrix3X const& data_points, SubdivEvaluator const& evaluator, Functor::InputType const& params) :
+      functor(data_points, evaluator),
+      params(params),
+      linearized(false)
+    {
+      functor.verbose = false;
+      functor.qr_threads = 1;
+    }
+
+    // Answer the coordinator's commands until told to quit
+    void serve(Channel& channel);
+    void reduce(Scalar lambda, JacobianType* S, VectorX* g, VectorX* d);
+    Scalar step(VectorX const& dX);
+  };
+
+private:
+  Scalar cost(std::vector<Channel>& channels, bool* ok);
+};
+
+inline std::vector<std::vector<int> > DistributedFitter::partition(Functor::InputType const& params) const
+{
+  MeshTopology const& mesh = evaluator.topology->mesh;
+  Index nFaces = Index(mesh.num_faces());
+
+  Vector3 extent = params.control_vertices.rowwise().maxCoeff() - params.control_vertices.rowwise().minCoeff();
+  Index axis;
+  extent.maxCoeff(&axis);
+
+  std::vector<std::pair<Scalar, int> > faces(nFaces);
+  for (Index f = 0; f < nFaces; ++f) {
+    Scalar c = 0;
+    for (int k = 0; k < 4; ++k)
+      c += params.control_vertices(axis, mesh.quads(k, f));
+    faces[f] = std::make_pair(c, int(f));
+  }
+  std::sort(faces.begin(), faces.end());
+
+  std::vector<std::vector<int> > by_face(nFaces);
+  for (int i = 0; i < int(params.us.size()); ++i)
+    by_face[params.us[i].face].push_back(i);
+
+  int parts = std::max(1, num_workers);
+  std::vector<std::vector<int> > points(parts);
+  size_t n = params.us.size();
+  size_t taken = 0;
+  int part = 0;
+  for (auto const& face : faces) {
+    std::vector<int> const& face_points = by_face[face.second];
+    points[part].insert(points[part].end(), face_points.begin(), face_points.end());
+    taken += face_points.size();
+    if (part + 1 < parts && taken * parts >= (part + 1) * n)
+      ++part;
+  }
+  return points;
+}
+
+inline void DistributedFitter::Worker::reduce(Scalar lambda, JacobianType* S, VectorX* g, VectorX* d)
+{
+  Index n = functor.data_points.cols();
+  Index m = 3 * params.nVertices();
+  if (!linearized) {
+    fvec.resize(3 * n);
+    functor(params, fvec);
+    functor.df(params, J);
+    linearized = true;
+  }
+  JacobianType J1 = J.leftCols(2 * n);
+  JacobianType J2 = J.rightCols(m);
+
+  // (H1 + D1)^-1, a 2x2 block per point
+  std::vector<Eigen::Triplet<Scalar> > blocks;
+  blocks.reserve(4 * n);
+  for (Index i = 0; i < n; ++i) {
+    Matrix32 A = Matrix32::Zero();
+    for (int c = 0; c < 2; ++c)
+      for (JacobianType::InnerIterator it(J1, 2 * i + c); it; ++it)
+        A(it.row() - 3 * i, c) = it.value();
+    Matrix22 H = A.transpose() * A;
+    for (int c = 0; c < 2; ++c)
+      H(c, c) += lambda * std::max(H(c, c), Scalar(1e-12));
+    Matrix22 Hinv = H.inverse();
+    for (int r = 0; r < 2; ++r)
+      for (int c = 0; c < 2; ++c)
+        blocks.push_back(Eigen::Triplet<Scalar>(int(2 * i + r), int(2 * i + c), Hinv(r, c)));
+  }
+  JacobianType Minv(2 * n, 2 * n);
+  Minv.setFromTriplets(blocks.begin(), blocks.end());
+
+  JacobianType C = J1.transpose() * J2;
+  Minv_C = Minv * C;
+  VectorX g1 = J1.transpose() * fvec;
+  Minv_g1 = Minv * g1;
+
+  JacobianType H2 = J2.transpose() * J2;
+  JacobianType CtMinvC = C.transpose() * Minv_C;
+  *S = H2 - CtMinvC;
+  S->makeCompressed();
+  *g = J2.transpose() * fvec - Minv_C.transpose() * g1;
+  *d = H2.diagonal();
+}
+
+inline Scalar DistributedFitter::Worker::step(VectorX const& dX)
+{
+  Index n = functor.data_points.cols();
+  VectorX p(2 * n + dX.size());
+  p.head(2 * n) = -(Minv_g1 + Minv_C * dX);
+  p.tail(dX.size()) = dX;
+
+  saved = params;
+  functor.increment_in_place(&params, p);
+  VectorX f(3 * n);
+  functor(params, f);
+  return f.squaredNorm();
+}
+
+inline void DistributedFitter::Worker::serve(Channel& channel)
+{
+  for (;;) {
+    int32_t command;
+    if (!channel.read(&command))
+      return;
+    switch (command) {
+    case CMD_COST: {
+      VectorX f(3 * functor.data_points.cols());
+      functor(params, f);
+      channel.write(f.squaredNorm());
+      break;
+    }
+    case CMD_REDUCE: {
+      Scalar lambda;
+      JacobianType S;
+      VectorX g, d;
+      if (!channel.read(&lambda))
+        return;
+      reduce(lambda, &S, &g, &d);
+      channel.write_sparse(S);
+      channel.write_matrix(g);
+      channel.write_matrix(d);
+      break;
+    }
+    case CMD_STEP: {
+      VectorX dX;
+      if (!channel.read_matrix(&dX, 3 * params.nVertices(), 1))
+        return;
+      channel.write(step(dX));
+      break;
+    }
+    case CMD_ACCEPT:
+      linearized = false;
+      break;
+    case CMD_REJECT:
+      params = saved;
+      break;
+    case CMD_GATHER: {
+      std::vector<int32_t> faces(params.us.size());
+      Matrix2X uvs(2, params.us.size());
+      for (size_t i = 0; i < params.us.size(); ++i) {
+        faces[i] = params.us[i].face;
+        uvs.col(i) = params.us[i].u;
+      }
+      channel.write(int64_t(faces.size()));
+      channel.write_bytes(faces.data(), faces.size() * sizeof(int32_t));
+      channel.write_matrix(uvs);
+      break;
+    }
+    case CMD_QUIT:
+    default:
+      return;
+    }
+  }
+}
+
+inline Scalar DistributedFitter::cost(std::vector<Channel>& channels, bool* ok)
+{
+  Scalar total = 0;
+  for (auto& channel : channels) {
+    Scalar c = 0;
+    *ok = *ok && channel.read(&c);
+    total += c;
+  }
+  return total;
+}
+
+inline Eigen::LevenbergMarquardtSpace::Status DistributedFitter::fit(Matrix3X const& data_points, Functor::InputType* params)
+{
+  using namespace Eigen::LevenbergMarquardtSpace;
+  std::vector<std::vector<int> > parts = partition(*params);
+  Index m = 3 * params->nVertices();
+
+  // Fork the workers, each with its partition
+  std::vector<Channel> channels;
+  std::vector<pid_t> pids;
+  for (auto const& points : parts) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+      break;
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    pid_t pid = fork();
+    if (pid == 0) {
+      ::close(fds[0]);
+      for (auto& channel : channels)
+        ::close(channel.fd);
+      Matrix3X worker_data(3, points.size());
+      Functor::InputType worker_params;
+      worker_params.control_vertices = params->control_vertices;
+      worker_params.us.resize(points.size());
+      for (size_t k = 0; k < points.size(); ++k) {
+        worker_data.col(k) = data_points.col(points[k]);
+        worker_params.us[k] = params->us[points[k]];
+      }
+      Channel channel(fds[1]);
+      Worker worker(worker_data, evaluator, worker_params);
+      worker.serve(channel);
+      // Skip the parent's atexit handlers and destructors
+      _exit(0);
+    }
+    ::close(fds[1]);
+    if (pid < 0) {
+      ::close(fds[0]);
+      break;
+    }
+    channels.push_back(Channel(fds[0]));
+    pids.push_back(pid);
+  }
+
+  bool ok = channels.size() == parts.size();
+  bytes_received = 0;
+  iterations = 0;
+  Status status = ok ? TooManyFunctionEvaluation : ImproperInputParameters;
+
+  Scalar current = 0;
+  if (ok) {
+    for (auto& channel : channels)
+      ok = ok && channel.write(int32_t(CMD_COST));
+    current = cost(channels, &ok);
+  }
+
+  Scalar lambda = initial_lambda;
+  while (ok && iterations < max_iterations) {
+    // Sum the workers' reduced systems
+    JacobianType S(m, m);
+    VectorX g = VectorX::Zero(m);
+    VectorX d = VectorX::Zero(m);
+    for (auto& channel : channels)
+      ok = ok && channel.write(int32_t(CMD_REDUCE)) && channel.write(lambda);
+    for (auto& channel : channels) {
+      JacobianType S_k;
+      VectorX g_k, d_k;
+      ok = ok && channel.read_sparse(&S_k, m, m) && channel.read_matrix(&g_k, m, 1) && channel.read_matrix(&d_k, m, 1);
+      if (!ok)
+        break;
+      S += S_k;
+      g += g_k;
+      d += d_k;
+      bytes_received += S_k.nonZeros() * (sizeof(Scalar) + sizeof(JacobianType::StorageIndex)) + (g_k.size() + d_k.size()) * sizeof(Scalar);
+    }
+    if (!ok)
+      break;
+
+    // Damp, including control vertices no point depends on
+    Scalar d_min = Scalar(1e-6) * std::max(d.maxCoeff(), Scalar(1e-12));
+    for (Index j = 0; j < m; ++j)
+      S.coeffRef(j, j) += lambda * std::max(d[j], d_min);
+    Eigen::SimplicialLDLT<JacobianType> ldlt(S);
+    if (ldlt.info() != Eigen::Success) {
+      lambda *= 10;
+      // Not positive definite however damped, as with NaNs in the workers' systems
+      if (!(lambda <= 1e12)) {
+        status = RelativeReductionTooSmall;
+        break;
+      }
+      continue;
+    }
+    VectorX dX = ldlt.solve(-g);
+
+    for (auto& channel : channels)
+      ok = ok && channel.write(int32_t(CMD_STEP)) && channel.write_matrix(dX);
+    Scalar trial = cost(channels, &ok);
+    if (!ok)
+      break;
+    ++iterations;
+
+    bool accept = trial < current;
+    for (auto& channel : channels)
+      ok = ok && channel.write(int32_t(accept ? CMD_ACCEPT : CMD_REJECT));
+    if (verbose)
+      std::cerr << "DistributedFitter: iteration " << iterations << ", lambda " << lambda << ", err = " << std::sqrt(trial)
+        << (accept ? "\n" : ", rejected\n");
+    if (accept) {
+      Map<VectorX>(params->control_vertices.data(), m) += dX;
+      Scalar reduction = (current - trial) / current;
+      current = trial;
+      lambda = std::max(lambda / 3, Scalar(1e-12));
+      if (reduction < tolerance || current == 0) {
+        status = RelativeReductionTooSmall;
+        break;
+      }
+    }
+    else {
+      lambda *= 10;
+      // No step lowers the error
+      if (!(lambda <= 1e12)) {
+        status = RelativeReductionTooSmall;
+        break;
+      }
+    }
+  }
+
+  // Collect the correspondences
+  for (size_t k = 0; ok && k < channels.size(); ++k) {
+    int64_t count = 0;
+    std::vector<int32_t> faces;
+    Matrix2X uvs;
+    ok = channels[k].write(int32_t(CMD_GATHER)) && channels[k].read(&count) && size_t(count) == parts[k].size();
+    faces.resize(ok ? size_t(count) : 0);
+    ok = ok && channels[k].read_bytes(faces.data(), faces.size() * sizeof(int32_t)) && channels[k].read_matrix(&uvs, 2, count);
+    for (size_t i = 0; ok && i < parts[k].size(); ++i)
+      ok = faces[i] >= 0 && faces[i] < int32_t(evaluator.topology->mesh.num_faces());
+    for (size_t i = 0; ok && i < parts[k].size(); ++i)
+      params->us[parts[k][i]] = { faces[i], uvs.col(i) };
+  }
+  if (!ok) {
+    std::cerr << "DistributedFitter: lost a worker\n";
+    status = ImproperInputParameters;
+  }
+
+  for (auto& channel : channels) {
+    channel.write(int32_t(CMD_QUIT));
+    ::close(channel.fd);
+  }
+  for (pid_t pid : pids)
+    waitpid(pid, 0, 0);
+
+  fnorm = std::sqrt(current);
+  if (verbose)
+    std::cerr << "DistributedFitter: " << channels.size() << " workers, " << iterations << " iterations, err = " << fnorm
+      << ", " << bytes_received / std::max(iterations, 1) << " bytes per iteration\n";
+  return status;
+}
+
+#endif
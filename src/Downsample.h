@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "SubdivEvaluator.h"
+#include "parallel.h"
+
+// Downsampling of dense scans before fitting: points are binned, by voxel or by cell of a grid
+// on each face, and each bin is replaced by the mean of its points, with their number as its
+// weight (see Subdiv3D_Functor::point_weights).  A weighted fit to the means then costs what the
+// surface's complexity needs, not what the scanner's density gives.
+//
+// Binning runs on num_threads threads: ranges of points are dealt into buckets by key, then each
+// bucket sums its bins, taking the ranges in order.  Ranges and buckets don't depend on
+// num_threads, so neither does the result, which is in key order.
+namespace downsample_detail {
+
+struct Bin {
+  uint64_t key;
+  Vector3 sum;
+  Vector2 uv_sum;
+  Eigen::Index count;
+};
+
+// key(i) is point i's bin; uvs, if given, are averaged too
+template <typename Key>
+std::vector<Bin> bin_points(Matrix3X const& points, std::vector<SurfacePoint> const* uvs, Key key, int num_threads)
+{
+  const Eigen::Index points_per_range = 1 << 16;
+  const int num_buckets = 64;
+  Eigen::Index n = points.cols();
+  int num_ranges = int((n + points_per_range - 1) / points_per_range);
+
+  // Point indices by range and bucket
+  std::vector<std::vector<std::pair<uint64_t, Eigen::Index> > > bucketed(size_t(num_ranges) * num_buckets);
+  parallel_for_stealing(num_ranges, num_threads, [&](int range, int) {
+    Eigen::Index end = std::min(n, (range + 1) * points_per_range);
+    for (Eigen::Index i = range * points_per_range; i < end; ++i) {
+      uint64_t k = key(i);
+      int bucket = int((k * 0x9E3779B97F4A7C15ull) >> 58);
+      bucketed[size_t(range) * num_buckets + bucket].push_back(std::make_pair(k, i));
+    }
+  });
+
+  std::vector<std::vector<Bin> > bucket_bins(num_buckets);
+  parallel_for_stealing(num_buckets, num_threads, [&](int bucket, int) {
+    std::unordered_map<uint64_t, size_t> index;
+    std::vector<Bin>& bins = bucket_bins[bucket];
+    for (int range = 0; range < num_ranges; ++range)
+      for (auto const& entry : bucketed[size_t(range) * num_buckets + bucket]) {
+        auto it = index.find(entry.first);
+        if (it == index.end()) {
+          it = index.insert(std::make_pair(entry.first, bins.size())).first;
+          bins.push_back({ entry.first, Vector3::Zero(), Vector2::Zero(), 0 });
+        }
+        Bin& bin = bins[it->second];
+        bin.sum += points.col(entry.second);
+        if (uvs)
+          bin.uv_sum += (*uvs)[entry.second].u;
+        ++bin.count;
+      }
+  });
+
+  std::vector<Bin> bins;
+  for (auto const& b : bucket_bins)
+    bins.insert(bins.end(), b.begin(), b.end());
+  std::sort(bins.begin(), bins.end(), [](Bin const& a, Bin const& b) { return a.key < b.key; });
+  return bins;
+}
+
+}
+
+// Bin the points into cubes of side voxel_size.  means gets each occupied voxel's mean point,
+// and counts its number of points.  Returns false, leaving them alone, unless voxel_size is
+// positive, the points are finite, and they span at most 2^21 voxels along each axis.
+inline bool voxel_downsample(Matrix3X const& points, Scalar voxel_size, Matrix3X* means, VectorX* counts,
+  int num_threads = default_num_threads())
+{
+  // 21 bits per axis
+  const int64_t max_cell = (int64_t(1) << 21) - 1;
+  if (!(voxel_size > 0) || !points.allFinite())
+    return false;
+  Vector3 origin = Vector3::Zero();
+  if (points.cols() > 0) {
+    origin = points.rowwise().minCoeff();
+    if (!(((points.rowwise().maxCoeff() - origin) / voxel_size).maxCoeff() < Scalar(max_cell)))
+      return false;
+  }
+  auto key = [&](Eigen::Index i) {
+    uint64_t k = 0;
+    for (int d = 0; d < 3; ++d) {
+      int64_t cell = int64_t(std::floor((points(d, i) - origin[d]) / voxel_size));
+      k = (k << 21) | uint64_t(std::min(std::max(cell, int64_t(0)), max_cell));
+    }
+    return k;
+  };
+  std::vector<downsample_detail::Bin> bins = downsample_detail::bin_points(points, 0, key, num_threads);
+
+  means->resize(3, bins.size());
+  counts->resize(bins.size());
+  for (size_t b = 0; b < bins.size(); ++b) {
+    means->col(b) = bins[b].sum / Scalar(bins[b].count);
+    (*counts)[b] = Scalar(bins[b].count);
+  }
+  return true;
+}
+
+// After correspondences are initialized: bin the points by cell of a grid x grid grid on their
+// face's (u,v) square.  Each cell's mean point gets the mean of its points' (u,v), as a
+// correspondence to start from.  Returns false, leaving the outputs alone, unless grid is positive.
+inline bool face_downsample(Matrix3X const& points, std::vector<SurfacePoint> const& us, int grid,
+  Matrix3X* means, std::vector<SurfacePoint>* mean_us, VectorX* counts, int num_threads = default_num_threads())
+{
+  if (grid <= 0)
+    return false;
+  // Clamped before the conversion, which would overflow for u far outside [0, 1] (or NaN)
+  auto cell = [grid](Scalar u) {
+    Scalar c = u * grid;
+    return uint64_t(c > 0 ? std::min(c, Scalar(grid - 1)) : Scalar(0));
+  };
+  auto key = [&](Eigen::Index i) {
+    return (uint64_t(us[i].face) * grid + cell(us[i].u[1])) * grid + cell(us[i].u[0]);
+  };
+  std::vector<downsample_detail::Bin> bins = downsample_detail::bin_points(points, &us, key, num_threads);
+
+  means->resize(3, bins.size());
+  mean_us->resize(bins.size());
+  counts->resize(bins.size());
+  for (size_t b = 0; b < bins.size(); ++b) {
+    Scalar count = Scalar(bins[b].count);
+    means->col(b) = bins[b].sum / count;
+    (*mean_us)[b] = { int(bins[b].key / (uint64_t(grid) * grid)), bins[b].uv_sum / count };
+    (*counts)[b] = count;
+  }
+  return true;
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "MeshTopology.h"
+#include "SubdivEvaluator.h"
+
+// Export of cages, tessellated surfaces (see Tessellation), correspondences and matrices, for
+// fits of millions of points.  Output goes through ExportWriter, which formats into a large
+// buffer and hands the stream whole blocks, so a file is written in a few large writes rather
+// than one per value (or, with std::endl, one flush per line).
+//
+// Meshes and points go to binary PLY (and meshes to OBJ, which is text only), matrices to a raw
+// format, read back by read_raw: an 8 char magic, OSDRAWDN or OSDRAWSP, then int64 rows and cols,
+// and for dense matrices the coefficients column by column, for sparse ones int64 nonzeros and
+// the compressed column arrays (int64 outer starts, int64 rows, values).  Scalars are written as
+// doubles, in native byte order.
+struct ExportWriter {
+  explicit ExportWriter(std::string const& filename, size_t buffer_size = size_t(4) << 20) :
+    out(filename.c_str(), std::ios::binary)
+  {
+    buffer.reserve(buffer_size);
+  }
+  ~ExportWriter() { flush(); }
+
+  bool good() const { return bool(out); }
+
+  void write_bytes(void const* data, size_t n)
+  {
+    if (buffer.size() + n > buffer.capacity()) {
+      flush();
+      if (n > buffer.capacity()) {
+        out.write((char const*)data, n);
+        return;
+      }
+    }
+    buffer.insert(buffer.end(), (char const*)data, (char const*)data + n);
+  }
+  template <typename T>
+  void write(T const& value) { write_bytes(&value, sizeof(T)); }
+
+  // Text, for headers and OBJ
+  void text(char const* s) { write_bytes(s, strlen(s)); }
+  template <typename... Args>
+  void format(char const* fmt, Args... args)
+  {
+    char line[256];
+    int n = snprintf(line, sizeof(line), fmt, args...);
+    write_bytes(line, size_t(std::min(n, int(sizeof(line)) - 1)));
+  }
+
+  bool flush()
+  {
+    out.write(buffer.data(), buffer.size());
+    buffer.clear();
+    out.flush();
+    return good();
+  }
+
+private:
+  std::ofstream out;
+  std::vector<char> buffer;
+};
+
+namespace export_detail {
+inline char const* ply_format()
+{
+  uint16_t one = 1;
+  return *(char const*)&one ? "binary_little_endian" : "binary_big_endian";
+}
+}
+
+// Binary PLY of a quad mesh, as float positions (and normals, if given)
+inline bool write_ply(std::string const& filename, MeshTopology const& mesh, Matrix3X const& vertices, Matrix3X const* normals = 0)
+{
+  ExportWriter out(filename);
+  out.format("ply\nformat %s 1.0\nelement vertex %lld\n", export_detail::ply_format(), (long long)vertices.cols());
+  out.text("property float x\nproperty float y\nproperty float z\n");
+  if (normals)
+    out.text("property float nx\nproperty float ny\nproperty float nz\n");
+  out.format("element face %lld\nproperty list uchar int vertex_indices\nend_header\n", (long long)mesh.quads.cols());
+  for (Eigen::Index i = 0; i < vertices.cols(); ++i) {
+    Eigen::Vector3f p = vertices.col(i).cast<float>();
+    out.write_bytes(p.data(), sizeof(p));
+    if (normals) {
+      Eigen::Vector3f n = normals->col(i).cast<float>();
+      out.write_bytes(n.data(), sizeof(n));
+    }
+  }
+  for (Eigen::Index f = 0; f < mesh.quads.cols(); ++f) {
+    out.write(uint8_t(4));
+    Eigen::Array<int32_t, 4, 1> quad = mesh.quads.col(f).cast<int32_t>();
+    out.write_bytes(quad.data(), sizeof(quad));
+  }
+  return out.flush();
+}
+
+inline bool write_obj(std::string const& filename, MeshTopology const& mesh, Matrix3X const& vertices, Matrix3X const* normals = 0)
+{
+  ExportWriter out(filename);
+  for (Eigen::Index i = 0; i < vertices.cols(); ++i)
+    out.format("v %.9g %.9g %.9g\n", vertices(0, i), vertices(1, i), vertices(2, i));
+  if (normals)
+    for (Eigen::Index i = 0; i < normals->cols(); ++i)
+      out.format("vn %.6g %.6g %.6g\n", (*normals)(0, i), (*normals)(1, i), (*normals)(2, i));
+  // 1-based, and the normals are per vertex
+  for (Eigen::Index f = 0; f < mesh.quads.cols(); ++f) {
+    int a = mesh.quads(0, f) + 1, b = mesh.quads(1, f) + 1, c = mesh.quads(2, f) + 1, d = mesh.quads(3, f) + 1;
+    if (normals)
+      out.format("f %d//%d %d//%d %d//%d %d//%d\n", a, a, b, b, c, c, d, d);
+    else
+      out.format("f %d %d %d %d\n", a, b, c, d);
+  }
+  return out.flush();
+}
+
+// Binary PLY of the data points with their correspondences (face, u, v) and, if given, their
+// residuals, e.g. as fvec from Subdiv3D_Functor, 3 per point
+inline bool write_correspondences_ply(std::string const& filename, Matrix3X const& data_points,
+  std::vector<SurfacePoint> const& us, VectorX const* residuals = 0)
+{
+  ExportWriter out(filename);
+  out.format("ply\nformat %s 1.0\nelement vertex %lld\n", export_detail::ply_format(), (long long)data_points.cols());
+  out.text("property float x\nproperty float y\nproperty float z\n");
+  out.text("property int face\nproperty float u\nproperty float v\n");
+  if (residuals)
+    out.text("property float rx\nproperty float ry\nproperty float rz\n");
+  out.text("end_header\n");
+  for (Eigen::Index i = 0; i < data_points.cols(); ++i) {
+    Eigen::Vector3f p = data_points.col(i).cast<float>();
+    out.write_bytes(p.data(), sizeof(p));
+    out.write(int32_t(us[i].face));
+    Eigen::Vector2f u = us[i].u.cast<float>();
+    out.write_bytes(u.data(), sizeof(u));
+    if (residuals) {
+      Eigen::Vector3f r = residuals->segment<3>(3 * i).cast<float>();
+      out.write_bytes(r.data(), sizeof(r));
+    }
+  }
+  return out.flush();
+}
+
+// Raw matrices, e.g. Jacobians, in the format above
+template <typename Derived>
+bool write_raw(std::string const& filename, Eigen::MatrixBase<Derived> const& m)
+{
+  ExportWriter out(filename);
+  out.write_bytes("OSDRAWDN", 8);
+  out.write(int64_t(m.rows()));
+  out.write(int64_t(m.cols()));
+  Eigen::MatrixXd dense = m.template cast<double>();
+  out.write_bytes(dense.data(), dense.size() * sizeof(double));
+  return out.flush();
+}
+
+template <typename T, int _Options, typename _Index>
+bool write_raw(std::string const& filename, Eigen::SparseMatrix<T, _Options, _Index> const& m)
+{
+  Eigen::SparseMatrix<double, Eigen::ColMajor, int64_t> csc = m.template cast<double>();
+  csc.makeCompressed();
+  ExportWriter out(filename);
+  out.write_bytes("OSDRAWSP", 8);
+  out.write(int64_t(csc.rows()));
+  out.write(int64_t(csc.cols()));
+  out.write(int64_t(csc.nonZeros()));
+  out.write_bytes(csc.outerIndexPtr(), (csc.cols() + 1) * sizeof(int64_t));
+  out.write_bytes(csc.innerIndexPtr(), csc.nonZeros() * sizeof(int64_t));
+  out.write_bytes(csc.valuePtr(), csc.nonZeros() * sizeof(double));
+  return out.flush();
+}
+
+namespace export_detail {
+// Bytes in the file after the header read so far, or -1 on error
+inline int64_t bytes_left(std::ifstream& in)
+{
+  std::streamoff pos = in.tellg();
+  if (!in.seekg(0, std::ios::end))
+    return -1;
+  std::streamoff end = in.tellg();
+  in.seekg(pos);
+  return in ? int64_t(end - pos) : -1;
+}
+}
+
+// read_raw returns false, leaving m empty, if the file is missing, has the other format, or its
+// sizes or (sparse) structure don't match its contents
+inline bool read_raw(std::string const& filename, Eigen::MatrixXd* m)
+{
+  m->resize(0, 0);
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  char magic[8];
+  int64_t rows, cols;
+  if (!in.read(magic, 8) || memcmp(magic, "OSDRAWDN", 8) != 0 ||
+      !in.read((char*)&rows, sizeof(rows)) || !in.read((char*)&cols, sizeof(cols)))
+    return false;
+  int64_t left = export_detail::bytes_left(in);
+  if (left < 0 || rows < 0 || cols < 0 || (cols > 0 && rows > left / int64_t(sizeof(double)) / cols) ||
+      rows * cols * int64_t(sizeof(double)) != left)
+    return false;
+  m->resize(rows, cols);
+  if (!in.read((char*)m->data(), m->size() * sizeof(double))) {
+    m->resize(0, 0);
+    return false;
+  }
+  return true;
+}
+
+inline bool read_raw(std::string const& filename, Eigen::SparseMatrix<double, Eigen::ColMajor, int64_t>* m)
+{
+  m->resize(0, 0);
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  char magic[8];
+  int64_t rows, cols, nnz;
+  if (!in.read(magic, 8) || memcmp(magic, "OSDRAWSP", 8) != 0 ||
+      !in.read((char*)&rows, sizeof(rows)) || !in.read((char*)&cols, sizeof(cols)) || !in.read((char*)&nnz, sizeof(nnz)))
+    return false;
+  // cols + 1 outer starts, then nnz rows and values
+  int64_t left = export_detail::bytes_left(in);
+  if (left < 0 || rows < 0 || cols < 0 || nnz < 0 ||
+      cols >= left / int64_t(sizeof(int64_t)) || nnz > left / int64_t(sizeof(int64_t) + sizeof(double)) ||
+      (cols + 1) * int64_t(sizeof(int64_t)) + nnz * int64_t(sizeof(int64_t) + sizeof(double)) != left)
+    return false;
+
+  std::vector<int64_t> outer(size_t(cols) + 1);
+  std::vector<int64_t> inner(nnz);
+  if (!in.read((char*)outer.data(), outer.size() * sizeof(int64_t)) ||
+      !in.read((char*)inner.data(), inner.size() * sizeof(int64_t)))
+    return false;
+  // The structure, before building the matrix on it
+  if (outer[0] != 0 || outer[cols] != nnz)
+    return false;
+  for (int64_t j = 0; j < cols; ++j) {
+    if (outer[j + 1] < outer[j])
+      return false;
+    for (int64_t k = outer[j]; k < outer[j + 1]; ++k)
+      if (inner[k] < 0 || inner[k] >= rows || (k > outer[j] && inner[k] <= inner[k - 1]))
+        return false;
+  }
+
+  m->resize(rows, cols);
+  m->resizeNonZeros(nnz);
+  std::copy(outer.begin(), outer.end(), m->outerIndexPtr());
+  std::copy(inner.begin(), inner.end(), m->innerIndexPtr());
+  if (!in.read((char*)m->valuePtr(), nnz * sizeof(double))) {
+    m->resize(0, 0);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,837 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <Eigen/Eigen>
+#include <Eigen/SparseCholesky>
+#include <Eigen/SparseQR>
+
+#include "eigen_extras.h"
+#include "parallel.h"
+
+// QR of many 3x2 blocks at once, in closed form.  A Householder reflection H1 zeroes a block's
+// first column below the diagonal, and a second one H2, on rows 1 and 2, its second column, so
+// Q^T = H2 H1.  The blocks are stored as structure of arrays, so the loops over them vectorize.
+// Columns are swapped only when the first is (numerically) zero, i.e. the block is rank deficient.
+// Blocks are independent, so ranges of them may be factored on different threads.
+template <typename Scalar>
+struct BlockQR3x2 {
+  typedef Eigen::Index Index;
+
+  // Input: entry (row, col) of block b is a[row + 3 * col][b]
+  std::vector<Scalar> a[6];
+
+  // Output: R, the reflectors v1 = [1 v1_1 v1_2] and v2 = [1 v2_1], and the column swaps
+  std::vector<Scalar> r00, r01, r11;
+  std::vector<Scalar> v1_1, v1_2, tau1, v2_1, tau2;
+  std::vector<char> swapped;
+
+  Index size() const { return Index(r00.size()); }
+
+  // Sizes the blocks and zeroes their entries
+  void resize(Index n)
+  {
+    for (int k = 0; k < 6; ++k)
+      a[k].assign(n, Scalar(0));
+    for (auto* v : { &r00, &r01, &r11, &v1_1, &v1_2, &tau1, &v2_1, &tau2 })
+      v->resize(n);
+    swapped.assign(n, 0);
+  }
+
+  // Factor blocks [begin, end), returning their total rank
+  Index factorize(Index begin, Index end)
+  {
+    Scalar const eps = Eigen::NumTraits<Scalar>::epsilon();
+
+    // Pivot the rare rank deficient blocks, so the loop below has no branches
+    for (Index b = begin; b < end; ++b) {
+      Scalar n0 = a[0][b] * a[0][b] + a[1][b] * a[1][b] + a[2][b] * a[2][b];
+      Scalar n1 = a[3][b] * a[3][b] + a[4][b] * a[4][b] + a[5][b] * a[5][b];
+      if (n0 <= eps * eps * n1) {
+        for (int row = 0; row < 3; ++row)
+          std::swap(a[row][b], a[row + 3][b]);
+        swapped[b] = 1;
+      }
+    }
+
+    Scalar* __restrict pr00 = r00.data(); Scalar* __restrict pr01 = r01.data(); Scalar* __restrict pr11 = r11.data();
+    Scalar* __restrict pv11 = v1_1.data(); Scalar* __restrict pv12 = v1_2.data(); Scalar* __restrict pt1 = tau1.data();
+    Scalar* __restrict pv21 = v2_1.data(); Scalar* __restrict pt2 = tau2.data();
+    Scalar const* a00 = a[0].data(); Scalar const* a10 = a[1].data(); Scalar const* a20 = a[2].data();
+    Scalar const* a01 = a[3].data(); Scalar const* a11 = a[4].data(); Scalar const* a21 = a[5].data();
+    for (Index b = begin; b < end; ++b) {
+      // H1: [a00 a10 a20] -> [beta 0 0], as in Eigen's makeHouseholder
+      Scalar tail1 = a10[b] * a10[b] + a20[b] * a20[b];
+      Scalar norm1 = std::sqrt(a00[b] * a00[b] + tail1);
+      Scalar beta1 = a00[b] >= 0 ? -norm1 : norm1;
+      bool reflect1 = tail1 > 0;
+      Scalar inv1 = reflect1 ? 1 / (a00[b] - beta1) : Scalar(0);
+      pv11[b] = a10[b] * inv1;
+      pv12[b] = a20[b] * inv1;
+      pt1[b] = reflect1 ? (beta1 - a00[b]) / beta1 : Scalar(0);
+      pr00[b] = reflect1 ? beta1 : a00[b];
+
+      // Second column through H1
+      Scalar d = pt1[b] * (a01[b] + pv11[b] * a11[b] + pv12[b] * a21[b]);
+      Scalar c0 = a01[b] - d;
+      Scalar c1 = a11[b] - d * pv11[b];
+      Scalar c2 = a21[b] - d * pv12[b];
+
+      // H2: [c1 c2] -> [beta 0]
+      Scalar tail2 = c2 * c2;
+      Scalar norm2 = std::sqrt(c1 * c1 + tail2);
+      Scalar beta2 = c1 >= 0 ? -norm2 : norm2;
+      bool reflect2 = tail2 > 0;
+      pv21[b] = reflect2 ? c2 / (c1 - beta2) : Scalar(0);
+      pt2[b] = reflect2 ? (beta2 - c1) / beta2 : Scalar(0);
+      pr01[b] = c0;
+      pr11[b] = reflect2 ? beta2 : c1;
+    }
+
+    Index rank = 0;
+    for (Index b = begin; b < end; ++b)
+      rank += !deficient(b, 0) + !deficient(b, 1);
+    return rank;
+  }
+
+  // Whether block b's pivot k (r00 or r11) is (numerically) zero: r11 is relative to the
+  // larger of the block's other entries, as the rounding of both columns ends up in it
+  bool deficient(Index b, int k) const
+  {
+    if (k == 0)
+      return r00[b] == 0;
+    Scalar threshold = 4 * Eigen::NumTraits<Scalar>::epsilon() * std::max(std::abs(r00[b]), std::abs(r01[b]));
+    return !(std::abs(r11[b]) > threshold);
+  }
+
+  // y = Q^T y for block b
+  void apply_qt(Index b, Scalar& y0, Scalar& y1, Scalar& y2) const
+  {
+    Scalar d = tau1[b] * (y0 + v1_1[b] * y1 + v1_2[b] * y2);
+    y0 -= d;
+    y1 -= d * v1_1[b];
+    y2 -= d * v1_2[b];
+    d = tau2[b] * (y1 + v2_1[b] * y2);
+    y1 -= d;
+    y2 -= d * v2_1[b];
+  }
+};
+
+template <typename QR, typename Rhs> class SchurlikeQRQtProduct;
+namespace Eigen {
+namespace internal {
+template <typename QR, typename Rhs>
+struct traits<SchurlikeQRQtProduct<QR, Rhs> > {
+  typedef typename Rhs::PlainObject ReturnType;
+};
+}
+}
+
+// QR of a Jacobian J = [J1 J2] whose first n_left columns J1 are block diagonal, with one 3x2
+// block per data point (rows 3i..3i+2, columns 2i, 2i+1), as Subdiv3D_Functor's are.
+// The blocks are factored by BlockQR3x2, and Q1^T applied to J2 in the same pass over the points.
+// That leaves, with the rows reordered so each block's third row comes last,
+//   Q1^T J = [R1 T ; 0 J2']
+// and J2' (one row per point) is factored by RightSolver, a dense QR, or SparseQR.  A row of a
+// rank deficient block with a zero pivot has only its T entries left, so it's moved into J2',
+// after the points' rows, leaving R1's deficient pivots zero in place (see solve_r).  So
+//   J P = Q [R1 T P2 ; 0 R2],  P = diag(P1, P2)
+// J2' has a column per control vertex coordinate, and a point's row is nonzero only for the
+// vertices its patch depends on, so for large cages it's mostly zeros, and too big to store dense
+// anyway: by default (RIGHT_AUTO) the dense solver is used only if J2' fits in dense_bytes and
+// either has few columns or is well filled.
+// The left part works on ranges of points on num_threads threads.  Each point's blocks, rows of T
+// and row of J2' depend only on that point, and T's entries are collected per range and joined
+// in range order, so the result is the same (bit for bit) for any number of threads.
+// Provides what Eigen::LevenbergMarquardt uses of a QR solver: compute, info, matrixR,
+// colsPermutation, rank, and matrixQ(), as products matrixQ().adjoint() * vector.
+//
+// All storage is in a Workspace.  LM makes a new solver every iteration, so give it one that
+// lives longer (see Subdiv3D_Functor::initQRSolver) and, once grown to size, factoring on one
+// thread with the dense right solver allocates nothing.  (Threads are started per call, and
+// SparseQR allocates internally.)
+template <typename _MatrixType, typename _RightSolver>
+class SchurlikeQR {
+public:
+  typedef _MatrixType MatrixType;
+  typedef _RightSolver RightSolver;
+  typedef typename MatrixType::Scalar Scalar;
+  typedef typename MatrixType::StorageIndex StorageIndex;
+  typedef Eigen::Index Index;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> VectorType;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> DenseMatrix;
+  typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, StorageIndex> PermutationType;
+
+  typedef Eigen::SparseMatrix<Scalar, Eigen::ColMajor, StorageIndex> SparseRightMatrix;
+  typedef Eigen::SparseQR<SparseRightMatrix, Eigen::COLAMDOrdering<StorageIndex> > SparseRightSolver;
+  typedef Eigen::SparseMatrix<Scalar, Eigen::RowMajor, StorageIndex> RowMajorMatrix;
+  typedef Eigen::Triplet<Scalar, StorageIndex> Triplet;
+
+  enum RightMode { RIGHT_AUTO, RIGHT_DENSE, RIGHT_SPARSE };
+
+  struct Workspace {
+    BlockQR3x2<Scalar> blocks;
+    RowMajorMatrix J2;            // J's right columns by rows
+    RightSolver right;
+    SparseRightSolver sparse_right;
+    DenseMatrix bottom;           // J2', if dense
+    SparseRightMatrix sparse_bottom;
+    MatrixType R;
+    PermutationType P;
+
+    // Per thread scratch for gathering a point's rows of J2
+    struct Scratch {
+      std::vector<Scalar> row_values;
+      std::vector<char> touched;
+      std::vector<Index> touched_cols;
+    };
+    std::vector<Scratch> scratch;
+    // Per range: entries of T and of J2', and rank
+    std::vector<std::vector<Triplet> > range_entries;
+    std::vector<std::vector<Triplet> > range_bottom;
+    std::vector<Index> range_rank;
+    // Assembly of R
+    std::vector<Triplet> R_entries;
+    std::vector<Triplet> bottom_entries;
+    std::vector<StorageIndex> p2, p2_inverse, triplet_scratch;
+    // For Q^T products
+    VectorType third;
+    // Rows of R1 with a zero pivot, moved to J2', in order, and per row of R1 its row of J2', or -1
+    std::vector<StorageIndex> moved_rows, bottom_row;
+
+    // Damped solves (see damp): R's T and R2^T R2, taken once per factorization, the points'
+    // damped 2x2 blocks, 3 entries per point, and the damped system in the control vertices,
+    // whose sparse Cholesky is analyzed only when its pattern changes.
+    SparseRightMatrix T;
+    SparseRightMatrix R2tR2;
+    DenseMatrix dense_R2tR2;
+    VectorType block_inverse;        // (B^-1)_00, (B^-1)_01, (B^-1)_11
+    SparseRightMatrix weights;       // Block diagonal I - K B^-1 K^T
+    SparseRightMatrix weighted_T, reduced;
+    DenseMatrix dense_reduced;
+    Eigen::LLT<DenseMatrix> dense_cholesky;
+    Eigen::SimplicialLLT<SparseRightMatrix> sparse_cholesky;
+    std::vector<StorageIndex> analyzed_outer, analyzed_inner;
+    VectorType rhs_right, point_scratch;
+
+    // LM's damping at its last schurlike_lmpar (see Subdiv3D_Functor's lmpar2), the trust region
+    // radius it was given and the parameter it chose, which LevenbergMarquardt doesn't expose.
+    // A resume_par > 0 replaces LM's parameter as the start of the next search, once.
+    Scalar lm_delta = 0, lm_par = 0, lm_resume_par = 0;
+  };
+
+  SchurlikeQR() : dense_bytes(size_t(512) << 20), dense_max_cols(300), dense_min_fill(0.2),
+    n_left(0), num_threads(1), right_mode(RIGHT_AUTO), ws(0), right_sparse(false), m_rank(0), m_right_rank(0), m_info(Eigen::InvalidInput),
+    damping_prepared(false) {}
+  explicit SchurlikeQR(MatrixType const& J) : SchurlikeQR() { compute(J); }
+
+  // Columns in the block diagonal part: 2 per data point
+  void setBlockParams(Index n) { n_left = n; }
+  void setNumThreads(int n) { num_threads = n; }
+  void setRightMode(RightMode mode) { right_mode = mode; }
+  // Must outlive the solver.  Without one, the solver makes its own.
+  void setWorkspace(Workspace* workspace) { ws = workspace; }
+  Workspace* workspace() const { return ws; }
+
+  // RIGHT_AUTO uses the dense solver if J2' takes at most dense_bytes dense, and has at most
+  // dense_max_cols columns or at least dense_min_fill of its entries nonzero
+  size_t dense_bytes;
+  Index dense_max_cols;
+  double dense_min_fill;
+  bool right_is_sparse() const { return right_sparse; }
+
+  void compute(MatrixType const& J);
+
+  Eigen::ComputationInfo info() const { return m_info; }
+  MatrixType const& matrixR() const { return ws->R; }
+  PermutationType const& colsPermutation() const { return ws->P; }
+  // The number of nonzero pivots.  Zero pivots of the point blocks are in place, so unlike a
+  // column pivoting QR's they aren't the trailing n - rank() columns: solve with solve_r.
+  Index rank() const { return m_rank; }
+  Index rows() const { return 3 * ws->blocks.size(); }
+  Index cols() const { return ws->R.cols(); }
+
+  // dst = Q^T v
+  template <typename Derived, typename Dest>
+  void apply_qt(Eigen::MatrixBase<Derived> const& v, Dest& dst) const;
+
+  struct QAdjoint {
+    SchurlikeQR const& qr;
+    template <typename Derived>
+    SchurlikeQRQtProduct<SchurlikeQR, Derived> operator*(Eigen::MatrixBase<Derived> const& v) const
+    {
+      return SchurlikeQRQtProduct<SchurlikeQR, Derived>(qr, v.derived());
+    }
+  };
+  struct QType {
+    SchurlikeQR const& qr;
+    QAdjoint adjoint() const { return QAdjoint{ qr }; }
+    QAdjoint transpose() const { return QAdjoint{ qr }; }
+  };
+  QType matrixQ() const { return QType{ *this }; }
+
+  RightSolver& getRightSolver() { return ws->right; }
+
+  // Least squares solution of R z = rhs, in R's column order, zero at the deficient pivots: the
+  // point blocks' (whose rows of R are zero) and R2's past its rank
+  template <typename Rhs, typename Dest>
+  void solve_r(Rhs const& rhs, Dest& z) const;
+
+  // Damped solves, for LM's choice of damping (see schurlike_lmpar), without refactoring J:
+  //   (R^T R + diag(lambda)) z = rhs
+  // in R's column order.  Point b's 2x2 block K of R and its two lambdas make a 2x2 system B,
+  // solved in closed form, and eliminating the points leaves
+  //   T^T W T + R2^T R2 + diag(lambda_right),  W = blockdiag(I - K B^-1 K^T)
+  // in the control vertices, which is Cholesky factored: dense if J2' was, else sparse, with
+  // the symbolic analysis (and its ordering) kept while the pattern stays the same, as it does
+  // over damping changes and, while the correspondences stay on their patches, iterations.
+  // damp returns false if B or that system isn't positive definite.
+  bool damp(VectorType const& lambda) const;
+  template <typename Rhs, typename Dest>
+  void damped_solve(Rhs const& rhs, Dest& z) const;
+
+private:
+  static const Index points_per_range = 4096;
+
+  Index n_left;
+  int num_threads;
+  RightMode right_mode;
+  std::unique_ptr<Workspace> own_workspace;
+  Workspace* ws;
+  bool right_sparse;            // Which solver factored J2'
+  Index m_rank;
+  Index m_right_rank;
+  Eigen::ComputationInfo m_info;
+  mutable bool damping_prepared;
+
+  Index num_ranges() const { return (ws->blocks.size() + points_per_range - 1) / points_per_range; }
+  void factorize_range(MatrixType const& J, Index begin, Index end, typename Workspace::Scratch& scratch,
+    std::vector<Triplet>& entries, std::vector<Triplet>& bottom_entries);
+};
+
+// Q^T v, evaluated straight into the destination, as LM's m_wa4 = Q^T fvec
+template <typename QR, typename Rhs>
+class SchurlikeQRQtProduct : public Eigen::ReturnByValue<SchurlikeQRQtProduct<QR, Rhs> > {
+public:
+  SchurlikeQRQtProduct(QR const& qr, Rhs const& rhs) : qr(qr), rhs(rhs) {}
+  Eigen::Index rows() const { return rhs.rows(); }
+  Eigen::Index cols() const { return rhs.cols(); }
+  template <typename Dest>
+  void evalTo(Dest& dst) const { qr.apply_qt(rhs, dst); }
+
+private:
+  QR const& qr;
+  Rhs const& rhs;
+};
+
+template <typename MatrixType, typename RightSolver>
+void SchurlikeQR<MatrixType, RightSolver>::compute(MatrixType const& J)
+{
+  Index N = n_left / 2;
+  Index M = J.cols() - n_left;
+  damping_prepared = false;
+  if (n_left <= 0 || n_left % 2 != 0 || J.rows() != 3 * N || M < 0 || !J.isCompressed()) {
+    m_info = Eigen::InvalidInput;
+    return;
+  }
+  if (!ws) {
+    own_workspace.reset(new Workspace);
+    ws = own_workspace.get();
+  }
+
+  // J2 by rows, so a point's rows can be walked: count the entries per row, then deal them out
+  // in column order
+  RowMajorMatrix& J2 = ws->J2;
+  StorageIndex const* J_outer = J.outerIndexPtr();
+  J2.resize(3 * N, M);
+  J2.resizeNonZeros(J_outer[n_left + M] - J_outer[n_left]);
+  StorageIndex* J2_outer = J2.outerIndexPtr();
+  for (StorageIndex k = J_outer[n_left]; k < J_outer[n_left + M]; ++k)
+    ++J2_outer[J.innerIndexPtr()[k] + 1];
+  for (Index r = 0; r < 3 * N; ++r)
+    J2_outer[r + 1] += J2_outer[r];
+  for (Index c = 0; c < M; ++c)
+    for (StorageIndex k = J_outer[n_left + c]; k < J_outer[n_left + c + 1]; ++k) {
+      StorageIndex pos = J2_outer[J.innerIndexPtr()[k]]++;
+      J2.innerIndexPtr()[pos] = StorageIndex(c);
+      J2.valuePtr()[pos] = J.valuePtr()[k];
+    }
+  for (Index r = 3 * N; r > 0; --r)
+    J2_outer[r] = J2_outer[r - 1];
+  J2_outer[0] = 0;
+
+  // 1, 2. The 3x2 blocks, and Q1^T J2, by ranges of points
+  ws->blocks.resize(N);
+  Index ranges = num_ranges();
+  ws->range_entries.resize(ranges);
+  ws->range_bottom.resize(ranges);
+  ws->range_rank.assign(ranges, 0);
+  ws->scratch.resize(std::max(num_threads, 1));
+  for (auto& s : ws->scratch) {
+    s.row_values.assign(3 * M, Scalar(0));
+    s.touched.assign(M, 0);
+  }
+  parallel_for_stealing(int(ranges), num_threads, [&](int range, int thread) {
+    Index begin = range * points_per_range;
+    Index end = std::min(N, begin + points_per_range);
+    factorize_range(J, begin, end, ws->scratch[thread], ws->range_entries[range], ws->range_bottom[range]);
+  });
+
+  size_t num_entries = 3 * N;
+  size_t bottom_nonzeros = 0;
+  Index left_rank = 0;
+  for (Index range = 0; range < ranges; ++range) {
+    num_entries += ws->range_entries[range].size();
+    bottom_nonzeros += ws->range_bottom[range].size();
+    left_rank += ws->range_rank[range];
+  }
+
+  // 3. Rows of R1 at zero pivots to J2', where their T entries go in step 4.  They're zero from
+  // the factorization, but for the r11 under the threshold.
+  BlockQR3x2<Scalar>& blocks = ws->blocks;
+  std::vector<StorageIndex>& moved_rows = ws->moved_rows;
+  std::vector<StorageIndex>& bottom_row = ws->bottom_row;
+  moved_rows.clear();
+  if (left_rank < n_left) {
+    for (Index b = 0; b < N; ++b)
+      for (int k = 0; k < 2; ++k)
+        if (blocks.deficient(b, k))
+          moved_rows.push_back(StorageIndex(2 * b + k));
+    bottom_row.assign(n_left, -1);
+    for (size_t k = 0; k < moved_rows.size(); ++k) {
+      StorageIndex row = moved_rows[k];
+      bottom_row[row] = StorageIndex(N + k);
+      if (row % 2 == 0)
+        blocks.r00[row / 2] = blocks.r01[row / 2] = 0;
+      else
+        blocks.r11[row / 2] = 0;
+    }
+  }
+  Index bottom_rows = N + Index(moved_rows.size());
+  bool moved = !moved_rows.empty();
+
+  // 4. J2' P2 = Q2 R2
+  switch (right_mode) {
+  case RIGHT_DENSE: right_sparse = false; break;
+  case RIGHT_SPARSE: right_sparse = true; break;
+  case RIGHT_AUTO:
+    right_sparse = double(N) * M * sizeof(Scalar) > dense_bytes ||
+      (M > dense_max_cols && bottom_nonzeros < dense_min_fill * double(N) * M);
+    break;
+  }
+  std::vector<StorageIndex>& p2 = ws->p2;
+  p2.resize(M);
+  Index right_rank;
+  if (right_sparse) {
+    ws->bottom_entries.clear();
+    for (auto const& entries : ws->range_bottom)
+      ws->bottom_entries.insert(ws->bottom_entries.end(), entries.begin(), entries.end());
+    if (moved)
+      for (auto const& entries : ws->range_entries)
+        for (auto const& t : entries)
+          if (bottom_row[t.row()] >= 0)
+            ws->bottom_entries.push_back(Triplet(bottom_row[t.row()], t.col(), t.value()));
+    set_from_triplets(ws->sparse_bottom, bottom_rows, M, ws->bottom_entries, &ws->triplet_scratch);
+    ws->sparse_right.compute(ws->sparse_bottom);
+    if (ws->sparse_right.info() != Eigen::Success) {
+      m_info = ws->sparse_right.info();
+      return;
+    }
+    for (Index j = 0; j < M; ++j)
+      p2[j] = StorageIndex(ws->sparse_right.colsPermutation().indices()[j]);
+    right_rank = ws->sparse_right.rank();
+    num_entries += ws->sparse_right.matrixR().nonZeros();
+  }
+  else {
+    ws->bottom.setZero(bottom_rows, M);
+    for (auto const& entries : ws->range_bottom)
+      for (auto const& t : entries)
+        ws->bottom(t.row(), t.col()) = t.value();
+    if (moved)
+      for (auto const& entries : ws->range_entries)
+        for (auto const& t : entries)
+          if (bottom_row[t.row()] >= 0)
+            ws->bottom(bottom_row[t.row()], t.col()) = t.value();
+    ws->right.compute(ws->bottom);
+    if (ws->right.info() != Eigen::Success) {
+      m_info = ws->right.info();
+      return;
+    }
+    for (Index j = 0; j < M; ++j)
+      p2[j] = StorageIndex(ws->right.colsPermutation().indices()[j]);
+    right_rank = ws->right.rank();
+    num_entries += M * (M + 1) / 2;
+  }
+
+  // 5. P, and R: T's columns (so far those of J2) go through P2
+  PermutationType& P = ws->P;
+  P.resize(J.cols());
+  for (Index b = 0; b < N; ++b) {
+    P.indices()[2 * b] = StorageIndex(2 * b + blocks.swapped[b]);
+    P.indices()[2 * b + 1] = StorageIndex(2 * b + 1 - blocks.swapped[b]);
+  }
+  std::vector<StorageIndex>& p2_inverse = ws->p2_inverse;
+  p2_inverse.resize(M);
+  for (Index j = 0; j < M; ++j) {
+    P.indices()[n_left + j] = StorageIndex(n_left + p2[j]);
+    p2_inverse[p2[j]] = StorageIndex(j);
+  }
+
+  std::vector<Triplet>& R_entries = ws->R_entries;
+  R_entries.clear();
+  R_entries.reserve(num_entries);
+  for (auto const& entries : ws->range_entries)
+    for (auto const& t : entries)
+      if (!moved || bottom_row[t.row()] < 0)
+        R_entries.push_back(Triplet(t.row(), StorageIndex(n_left + p2_inverse[t.col()]), t.value()));
+  // The zeroed pivots stay as explicit zeros, so R has all its diagonal for triangular solves
+  for (Index b = 0; b < N; ++b) {
+    StorageIndex i = StorageIndex(2 * b);
+    R_entries.push_back(Triplet(i, i, blocks.r00[b]));
+    R_entries.push_back(Triplet(i, i + 1, blocks.r01[b]));
+    R_entries.push_back(Triplet(i + 1, i + 1, blocks.r11[b]));
+  }
+  if (right_sparse) {
+    SparseRightMatrix const& R2 = ws->sparse_right.matrixR();
+    for (Index c = 0; c < R2.outerSize(); ++c)
+      for (typename SparseRightMatrix::InnerIterator it(R2, c); it; ++it)
+        if (it.row() <= c)
+          R_entries.push_back(Triplet(StorageIndex(n_left + it.row()), StorageIndex(n_left + c), it.value()));
+  }
+  else {
+    DenseMatrix const& qr = ws->right.matrixQR();
+    for (Index c = 0; c < M; ++c)
+      for (Index r = 0; r <= std::min(c, bottom_rows - 1); ++r)
+        R_entries.push_back(Triplet(StorageIndex(n_left + r), StorageIndex(n_left + c), qr(r, c)));
+  }
+  set_from_triplets(ws->R, J.cols(), J.cols(), R_entries, &ws->triplet_scratch);
+
+  m_rank = left_rank + right_rank;
+  m_right_rank = right_rank;
+  m_info = Eigen::Success;
+}
+
+template <typename MatrixType, typename RightSolver>
+template <typename Derived, typename Dest>
+void SchurlikeQR<MatrixType, RightSolver>::apply_qt(Eigen::MatrixBase<Derived> const& v, Dest& dst) const
+{
+  Index N = ws->blocks.size();
+  assert(v.size() == 3 * N && dst.size() == 3 * N);
+  std::vector<StorageIndex> const& moved_rows = ws->moved_rows;
+  Index bottom_rows = N + Index(moved_rows.size());
+  VectorType& third = ws->third;
+  third.resize(bottom_rows);
+  parallel_for_stealing(int(num_ranges()), num_threads, [&](int range, int) {
+    Index end = std::min(N, (range + 1) * points_per_range);
+    for (Index b = range * points_per_range; b < end; ++b) {
+      Scalar y0 = v[3 * b], y1 = v[3 * b + 1], y2 = v[3 * b + 2];
+      ws->blocks.apply_qt(b, y0, y1, y2);
+      dst[2 * b] = y0;
+      dst[2 * b + 1] = y1;
+      third[b] = y2;
+    }
+  });
+  for (size_t k = 0; k < moved_rows.size(); ++k)
+    third[N + k] = dst[moved_rows[k]];
+  if (right_sparse) {
+    VectorType q2t = ws->sparse_right.matrixQ().adjoint() * third;
+    third = q2t;
+  }
+  else {
+    // Q2^T = H_{k-1} ... H_0, applied a reflector at a time: householderQ() products evaluate
+    // tau * v into a temporary
+    DenseMatrix const& qr = ws->right.matrixQR();
+    Index length = ws->right.hCoeffs().size();
+    for (Index k = 0; k < length; ++k) {
+      Index tail = bottom_rows - k - 1;
+      Scalar tau = ws->right.hCoeffs()[k];
+      Scalar dot = third[k] + qr.col(k).tail(tail).dot(third.tail(tail));
+      third[k] -= tau * dot;
+      third.tail(tail) -= (tau * dot) * qr.col(k).tail(tail);
+    }
+  }
+  // The moved rows' entries of Q2^T are past R2's, so only add to the residual
+  dst.tail(N) = third.head(N);
+  for (size_t k = 0; k < moved_rows.size(); ++k)
+    dst[moved_rows[k]] = third[N + k];
+}
+
+template <typename MatrixType, typename RightSolver>
+template <typename Rhs, typename Dest>
+void SchurlikeQR<MatrixType, RightSolver>::solve_r(Rhs const& rhs, Dest& z) const
+{
+  MatrixType const& R = ws->R;
+  StorageIndex const* outer = R.outerIndexPtr();
+  StorageIndex const* inner = R.innerIndexPtr();
+  Scalar const* values = R.valuePtr();
+  bool moved = !ws->moved_rows.empty();
+  z = rhs;
+  // By columns, whose rows are sorted, so the pivot is last
+  for (Index j = R.cols() - 1; j >= 0; --j) {
+    bool deficient = j < n_left ? moved && ws->bottom_row[j] >= 0 : j - n_left >= m_right_rank;
+    if (deficient) {
+      z[j] = 0;
+      continue;
+    }
+    StorageIndex last = outer[j + 1] - 1;
+    assert(last >= outer[j] && inner[last] == j);
+    z[j] /= values[last];
+    for (StorageIndex k = outer[j]; k < last; ++k)
+      z[inner[k]] -= values[k] * z[j];
+  }
+}
+
+template <typename MatrixType, typename RightSolver>
+bool SchurlikeQR<MatrixType, RightSolver>::damp(VectorType const& lambda) const
+{
+  Index N = ws->blocks.size();
+  Index M = ws->R.cols() - n_left;
+  assert(lambda.size() == ws->R.cols());
+  BlockQR3x2<Scalar> const& blocks = ws->blocks;
+
+  // What doesn't depend on the damping: R's T and R2, and the pattern of W
+  if (!damping_prepared) {
+    ws->T = ws->R.topRightCorner(n_left, M);
+    SparseRightMatrix R2 = ws->R.bottomRightCorner(M, M);
+    if (right_sparse)
+      ws->R2tR2 = SparseRightMatrix(R2.transpose()) * R2;
+    else {
+      DenseMatrix dense_R2 = R2;
+      ws->dense_R2tR2.noalias() = dense_R2.transpose() * dense_R2;
+    }
+    // Both rows of a block in both its columns
+    SparseRightMatrix& W = ws->weights;
+    W.resize(n_left, n_left);
+    W.resizeNonZeros(2 * n_left);
+    for (Index c = 0; c <= n_left; ++c)
+      W.outerIndexPtr()[c] = StorageIndex(2 * c);
+    for (Index c = 0; c < n_left; ++c) {
+      W.innerIndexPtr()[2 * c] = StorageIndex(c & ~Index(1));
+      W.innerIndexPtr()[2 * c + 1] = StorageIndex(c | 1);
+    }
+    damping_prepared = true;
+  }
+
+  // Each point's B = K^T K + diag(lambda) and W = I - K B^-1 K^T, with K = [r00 r01 ; 0 r11]
+  ws->block_inverse.resize(3 * N);
+  Scalar* W = ws->weights.valuePtr();
+  for (Index b = 0; b < N; ++b) {
+    Scalar r00 = blocks.r00[b], r01 = blocks.r01[b], r11 = blocks.r11[b];
+    Scalar b00 = r00 * r00 + lambda[2 * b];
+    Scalar b01 = r00 * r01;
+    Scalar b11 = r01 * r01 + r11 * r11 + lambda[2 * b + 1];
+    Scalar det = b00 * b11 - b01 * b01;
+    if (!(det > 0))
+      return false;
+    Scalar i00 = b11 / det, i01 = -b01 / det, i11 = b00 / det;
+    ws->block_inverse[3 * b] = i00;
+    ws->block_inverse[3 * b + 1] = i01;
+    ws->block_inverse[3 * b + 2] = i11;
+    // K B^-1 = [a c ; d e]
+    Scalar a = r00 * i00 + r01 * i01, c = r00 * i01 + r01 * i11;
+    Scalar d = r11 * i01, e = r11 * i11;
+    W[4 * b] = 1 - (a * r00 + c * r01);
+    W[4 * b + 1] = -(d * r00 + e * r01);
+    W[4 * b + 2] = -c * r11;
+    W[4 * b + 3] = 1 - e * r11;
+  }
+
+  // The system in the control vertices
+  ws->weighted_T = ws->weights * ws->T;
+  if (right_sparse) {
+    ws->reduced = SparseRightMatrix(ws->T.transpose()) * ws->weighted_T + ws->R2tR2;
+    // Its diagonal is all there for the Cholesky, so the pattern doesn't depend on zeros of W
+    ws->reduced.reserve(Eigen::VectorXi::Constant(M, 1));
+    for (Index j = 0; j < M; ++j)
+      ws->reduced.coeffRef(j, j) += lambda[n_left + j];
+    ws->reduced.makeCompressed();
+    StorageIndex const* outer = ws->reduced.outerIndexPtr();
+    StorageIndex const* inner = ws->reduced.innerIndexPtr();
+    Index nnz = ws->reduced.nonZeros();
+    if (Index(ws->analyzed_outer.size()) != M + 1 || Index(ws->analyzed_inner.size()) != nnz ||
+        !std::equal(outer, outer + M + 1, ws->analyzed_outer.begin()) ||
+        !std::equal(inner, inner + nnz, ws->analyzed_inner.begin())) {
+      ws->sparse_cholesky.analyzePattern(ws->reduced);
+      ws->analyzed_outer.assign(outer, outer + M + 1);
+      ws->analyzed_inner.assign(inner, inner + nnz);
+    }
+    ws->sparse_cholesky.factorize(ws->reduced);
+    return ws->sparse_cholesky.info() == Eigen::Success;
+  }
+  ws->dense_reduced = ws->dense_R2tR2;
+  ws->dense_reduced += SparseRightMatrix(SparseRightMatrix(ws->T.transpose()) * ws->weighted_T);
+  ws->dense_reduced.diagonal() += lambda.tail(M);
+  ws->dense_cholesky.compute(ws->dense_reduced);
+  return ws->dense_cholesky.info() == Eigen::Success;
+}
+
+// After damp: eliminate the points from rhs, solve in the control vertices, and back substitute
+template <typename MatrixType, typename RightSolver>
+template <typename Rhs, typename Dest>
+void SchurlikeQR<MatrixType, RightSolver>::damped_solve(Rhs const& rhs, Dest& z) const
+{
+  Index N = ws->blocks.size();
+  Index M = ws->R.cols() - n_left;
+  BlockQR3x2<Scalar> const& blocks = ws->blocks;
+  Scalar const* inverse = ws->block_inverse.data();
+  z.resize(n_left + M);
+
+  // u = K B^-1 rhs_left
+  VectorType& u = ws->point_scratch;
+  u.resize(n_left);
+  for (Index b = 0; b < N; ++b) {
+    Scalar y0 = inverse[3 * b] * rhs[2 * b] + inverse[3 * b + 1] * rhs[2 * b + 1];
+    Scalar y1 = inverse[3 * b + 1] * rhs[2 * b] + inverse[3 * b + 2] * rhs[2 * b + 1];
+    u[2 * b] = blocks.r00[b] * y0 + blocks.r01[b] * y1;
+    u[2 * b + 1] = blocks.r11[b] * y1;
+  }
+  ws->rhs_right = rhs.tail(M);
+  ws->rhs_right.noalias() -= ws->T.transpose() * u;
+  if (right_sparse)
+    z.tail(M) = ws->sparse_cholesky.solve(ws->rhs_right);
+  else
+    z.tail(M) = ws->dense_cholesky.solve(ws->rhs_right);
+
+  // z_left = B^-1 (rhs_left - K^T T z_right)
+  u.noalias() = ws->T * z.tail(M);
+  for (Index b = 0; b < N; ++b) {
+    Scalar t0 = rhs[2 * b] - blocks.r00[b] * u[2 * b];
+    Scalar t1 = rhs[2 * b + 1] - blocks.r01[b] * u[2 * b] - blocks.r11[b] * u[2 * b + 1];
+    z[2 * b] = inverse[3 * b] * t0 + inverse[3 * b + 1] * t1;
+    z[2 * b + 1] = inverse[3 * b + 1] * t0 + inverse[3 * b + 2] * t1;
+  }
+}
+
+// Blocks [begin, end): gather and factor them, then apply their Q^T to their rows of J2, into T's
+// entries and J2'
+template <typename MatrixType, typename RightSolver>
+void SchurlikeQR<MatrixType, RightSolver>::factorize_range(MatrixType const& J, Index begin, Index end,
+  typename Workspace::Scratch& scratch, std::vector<Triplet>& entries, std::vector<Triplet>& bottom_entries)
+{
+  BlockQR3x2<Scalar>& blocks = ws->blocks;
+  for (Index c = 2 * begin; c < 2 * end; ++c)
+    for (typename MatrixType::InnerIterator it(J, c); it; ++it) {
+      Index b = c / 2;
+      Index row = it.row() - 3 * b;
+      assert(0 <= row && row < 3);
+      blocks.a[row + 3 * (c % 2)][b] = it.value();
+    }
+  ws->range_rank[begin / points_per_range] = blocks.factorize(begin, end);
+
+  // Q1^T J2, a point at a time: the top two rows go to T, the third to J2'.  The scratch is
+  // left zeroed for the next range.
+  RowMajorMatrix const& J2 = ws->J2;
+  entries.clear();
+  bottom_entries.clear();
+  for (Index b = begin; b < end; ++b) {
+    scratch.touched_cols.clear();
+    for (int k = 0; k < 3; ++k)
+      for (typename RowMajorMatrix::InnerIterator it(J2, 3 * b + k); it; ++it) {
+        Index c = it.col();
+        if (!scratch.touched[c]) {
+          scratch.touched[c] = 1;
+          scratch.touched_cols.push_back(c);
+        }
+        scratch.row_values[3 * c + k] += it.value();
+      }
+    for (Index c : scratch.touched_cols) {
+      Scalar* y = &scratch.row_values[3 * c];
+      blocks.apply_qt(b, y[0], y[1], y[2]);
+      entries.push_back(Triplet(StorageIndex(2 * b), StorageIndex(c), y[0]));
+      entries.push_back(Triplet(StorageIndex(2 * b + 1), StorageIndex(c), y[1]));
+      bottom_entries.push_back(Triplet(StorageIndex(b), StorageIndex(c), y[2]));
+      y[0] = y[1] = y[2] = 0;
+      scratch.touched[c] = 0;
+    }
+  }
+}
+
+// Eigen::internal::lmpar2 for SchurlikeQR (see the specialization in Subdiv3D_Functor.h): the
+// same search for the Levenberg-Marquardt parameter par, but each trial par costs a damp and
+// damped_solve instead of Givens rotations of a copy of R.  As LM reuses the factorization for
+// the steps it rejects, those then cost the reduced system, not a pass over all the points' R.
+template <typename QR, typename VectorType>
+void schurlike_lmpar(QR const& qr, VectorType const& diag, VectorType const& qtb,
+  typename VectorType::Scalar delta, typename VectorType::Scalar& par, VectorType& x)
+{
+  typedef typename VectorType::Scalar Scalar;
+  using std::abs;
+  typename QR::MatrixType const& R = qr.matrixR();
+  Eigen::Index n = R.cols();
+  Eigen::Index rank = qr.rank();
+  auto const& P = qr.colsPermutation();
+  const Scalar dwarf = (std::numeric_limits<Scalar>::min)();
+
+  // The Gauss-Newton direction, least squares if J is rank deficient
+  VectorType wa1, wa2;
+  qr.solve_r(qtb, wa1);
+  x = P * wa1;
+  wa2 = diag.cwiseProduct(x);
+  Scalar dxnorm = wa2.blueNorm();
+  Scalar fp = dxnorm - delta;
+  if (fp <= Scalar(0.1) * delta) {
+    par = 0;
+    return;
+  }
+
+  // Bounds on par: parl from the Newton step if J has full rank, paru from the gradient
+  Scalar parl = 0;
+  if (rank == n) {
+    wa1 = P.inverse() * diag.cwiseProduct(wa2) / dxnorm;
+    R.transpose().template triangularView<Eigen::Lower>().solveInPlace(wa1);
+    Scalar temp = wa1.blueNorm();
+    parl = fp / delta / temp / temp;
+  }
+  VectorType permuted_diag(n);
+  for (Eigen::Index j = 0; j < n; ++j)
+    permuted_diag[j] = diag[P.indices()[j]];
+  VectorType gradient = R.transpose() * qtb;
+  Scalar gnorm = gradient.cwiseQuotient(permuted_diag).stableNorm();
+  Scalar paru = gnorm / delta;
+  if (paru == 0)
+    paru = dwarf / (std::min)(delta, Scalar(0.1));
+
+  par = (std::max)(par, parl);
+  par = (std::min)(par, paru);
+  if (par == 0)
+    par = gnorm / dxnorm;
+
+  VectorType z;
+  for (int iter = 1; ; ++iter) {
+    if (par == 0)
+      par = (std::max)(dwarf, Scalar(0.001) * paru);
+    // The damped system is positive definite, but may not be numerically for tiny par.  Give
+    // up, with no step, if a larger par doesn't help, as when J or qtb isn't finite.
+    int tries = 0;
+    while (!qr.damp(par * permuted_diag.cwiseAbs2())) {
+      par = (std::max)(Scalar(10) * par, Scalar(0.001) * paru);
+      if (!(par <= (std::numeric_limits<Scalar>::max)()) || ++tries == 30) {
+        x.setZero(n);
+        return;
+      }
+    }
+    qr.damped_solve(gradient, z);
+    x = P * z;
+    wa2 = diag.cwiseProduct(x);
+    dxnorm = wa2.blueNorm();
+    Scalar temp = fp;
+    fp = dxnorm - delta;
+    if (abs(fp) <= Scalar(0.1) * delta || (parl == 0 && fp <= temp && temp < 0) || iter == 10)
+      break;
+
+    // Newton correction, from w^T (R^T R + par D^2)^-1 w
+    wa1 = P.inverse() * diag.cwiseProduct(wa2 / dxnorm);
+    qr.damped_solve(wa1, z);
+    Scalar parc = fp / delta / wa1.dot(z);
+    if (fp > 0)
+      parl = (std::max)(parl, par);
+    if (fp < 0)
+      paru = (std::min)(paru, par);
+    par = (std::max)(parl, par + parc);
+  }
+}
@@ -0,0 +1,614 @@
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+#include <Eigen/Eigen>
+#include <Eigen/SparseQR>
+
+#include <unsupported/Eigen/LevenbergMarquardt>
+#include <unsupported/Eigen/SparseExtra>
+#include "unsupported/Eigen/src/SparseExtra/BlockSparseQR.h"
+#include "unsupported/Eigen/src/SparseExtra/BlockDiagonalSparseQR.h"
+
+#include "eigen_extras.h"
+#include "MeshTopology.h"
+#include "SubdivEvaluator.h"
+#include "SchurlikeQR.h"
+#include "AllocationCounter.h"
+
+using namespace Eigen;
+
+// Brute-force correspondence initialization: each data point takes the closest of a grid of
+// (grid x grid) test points on every face.  If 'which' is given, only those points are updated.
+inline void init_correspondences(SubdivEvaluator const& evaluator, Matrix3X const& control_vertices,
+  Matrix3X const& data, std::vector<SurfacePoint>* us, std::vector<int> const* which = 0, int grid = 1)
+{
+  size_t nFaces = evaluator.topology->mesh.num_faces();
+
+  // 1. Make a list of test points, e.g. centre point of each face
+  std::vector<SurfacePoint> uvs;
+  uvs.reserve(nFaces * grid * grid);
+  for (int face = 0; face < int(nFaces); ++face)
+    for (int i = 0; i < grid; ++i)
+      for (int j = 0; j < grid; ++j)
+        uvs.push_back({ face,{ (i + Scalar(0.5)) / grid, (j + Scalar(0.5)) / grid } });
+
+  Matrix3X test_points(3, uvs.size());
+  evaluator.evaluateSubdivSurface(control_vertices, uvs, &test_points);
+
+  // 2. Closest test point
+  Index n = which ? Index(which->size()) : data.cols();
+  for (Index k = 0; k < n; k++) {
+    Index i = which ? (*which)[k] : k;
+    Eigen::Index test_pt_index;
+    (test_points.colwise() - data.col(i)).colwise().squaredNorm().minCoeff(&test_pt_index);
+    (*us)[i] = uvs[test_pt_index];
+  }
+}
+
+struct Subdiv3D_Functor : Eigen::SparseFunctor<Scalar>
+{
+  typedef Eigen::SparseFunctor<Scalar> Base;
+  typedef typename Base::JacobianType JacobianType;
+
+  // Input data
+  Matrix3X data_points;
+  // Per point weights, e.g. the counts of points a downsampled point stands for (see
+  // Downsample.h): point i's residual is scaled by sqrt(weight i).  Empty for all 1.
+  VectorX point_weights;
+  Scalar residual_scale(Index i) const { return point_weights.size() > 0 ? std::sqrt(point_weights[i]) : Scalar(1); }
+
+  // Residuals, in operator(), are evaluated with evaluator.backend, so an Osd backend can do LM's
+  // residual passes (see SubdivEvaluator::Backend).  Those are in float, so near convergence LM
+  // may reject steps whose improvement is below float rounding.  df always uses the native kernels.
+  SubdivEvaluator evaluator;
+
+  // Topology (faces as vertex indices, fixed during shape optimization), shared with the evaluator
+  MeshTopology const& mesh;
+
+  // Print mesh-walking stats in increment_in_place, and the active set size in df
+  bool verbose;
+
+  // Active set: df freezes a point whose last u-step and change in squared residual both fall
+  // below these tolerances.  A frozen point's two u-columns of the Jacobian are zero, so its block
+  // is a zero pivot of the QR (see SchurlikeQR), which gives it exactly no step, and
+  // increment_in_place skips its mesh walking.  Every recheck_interval'th df thaws all points,
+  // and they freeze again if they've stayed settled.
+  bool use_active_set;
+  Scalar freeze_du_tol;
+  Scalar freeze_residual_tol;
+  int recheck_interval;
+  Index num_active;     // Points active in the last df
+
+  // Functor constructor
+  Subdiv3D_Functor(const Matrix3X& data_points, const MeshTopology& mesh) :
+    Subdiv3D_Functor(data_points, SubdivEvaluator(mesh))
+  {
+  }
+
+  // Construct from an existing evaluator, sharing its topology (see SubdivTopology)
+  Subdiv3D_Functor(const Matrix3X& data_points, const SubdivEvaluator& evaluator) :
+    Base(evaluator.topology->nVertices*3 + data_points.cols()*2,   /* number of parameters */
+         data_points.cols()*3),                                    /* number of residuals */
+    data_points(data_points), 
+    evaluator(evaluator),
+    mesh(this->evaluator.topology->mesh),
+    verbose(true),
+    use_active_set(false),
+    freeze_du_tol(Scalar(1e-4)),
+    freeze_residual_tol(Scalar(1e-6)),
+    recheck_interval(5),
+    num_active(data_points.cols()),
+    memory_budget(size_t(256) << 20),
+    allocations(0),
+    reorder_points(true),
+    cache_basis(true),
+    qr_threads(default_num_threads()),
+    num_df(0)
+  {
+  }
+
+  // Variables for optimization live in InputType
+  struct InputType {
+    Matrix3X control_vertices;
+    std::vector<SurfacePoint> us;
+
+    Index nVertices() const { return control_vertices.cols();  }
+  };
+
+  // Optional hook called at the end of every increment_in_place, e.g. to record a fit timeline.
+  // Note LM calls increment_in_place for every trial step, including ones it then rejects.
+  std::function<void(InputType const&)> increment_hook;
+  // The last step increment_in_place took: once LM's minimizeOneStep returns, the accepted one
+  StepType last_step;
+
+  // And the optimization steps are computed using VectorType.
+  // For subdivs (see xx), the correspondences are of type (int, Vec2) while the updates are of type (Vec2).
+  // The iteractions between InputType and VectorType are restricted to:
+  //   The Jacobian computation takeas an InputType, and its worows must easily convert to VectorType
+  //   The increment_in_place operation takes InputType and StepType. 
+  typedef VectorX VectorType;
+
+  // Points are evaluated in chunks, so the workspaces below hold one chunk rather than all points.
+  // The chunk size is chosen to keep them within memory_budget bytes; set it before the fit.
+  // Chunks are all the same size, the last one padded by repeating its last point, so the
+  // workspaces keep their size (and storage) from one chunk and iteration to the next.
+  size_t memory_budget;
+  Index chunk_size() const
+  {
+    // S, dSdu, dSdv and the surface point per point, and dSdX's triplets (16 CVs, but each
+    // may be a local point spreading over several cage vertices, and the evaluator reserves MAX_NUM_W)
+    size_t bytes_per_point = 9 * sizeof(Scalar) + sizeof(SurfacePoint) + 2 * MAX_NUM_W * sizeof(Eigen::Triplet<Scalar>);
+    Index n = std::max<Index>(1, Index(memory_budget / bytes_per_point));
+    Index nPoints = std::max<Index>(1, data_points.cols());
+    // As even as possible, so the padding is less than one point per chunk
+    Index chunks = (nPoints + n - 1) / n;
+    return (nPoints + chunks - 1) / chunks;
+  }
+
+  // Workspace variables for evaluation, one chunk's worth
+  std::vector<SurfacePoint> chunk_us;
+  Matrix3X S;
+  Matrix3X dSdu;
+  Matrix3X dSdv;
+  SubdivEvaluator::triplets_t dSdX;
+  // Jacobian triplets, kept so their storage survives between iterations (and frames, see SubdivTracker)
+  Eigen::TripletArray<Scalar, typename JacobianType::Index> jvals;
+  std::vector<typename JacobianType::StorageIndex> jacobian_scratch;   // For set_from_triplets
+  // For increment_u_crossing_edges' evaluations at the edges it crosses
+  std::vector<SurfacePoint> hop_us;
+  Matrix3X hop_S, hop_Su, hop_Sv;
+  // Heap allocations (see AllocationCounter.h) in operator(), df and increment_in_place, which
+  // once the workspaces have grown to size should be none.  The counter is process wide, so this
+  // includes other threads' allocations during those calls.
+  long long allocations;
+
+  // Points are visited in this order, by patch if reorder_points is set (see
+  // SubdivEvaluator::patch_order_permutation), so chunks cover few patches and consecutive points
+  // share CV gathers.  Residuals and Jacobian rows stay in data_points order.
+  bool reorder_points;
+  std::vector<int> point_order;
+  SubdivEvaluator::OrderKeys point_order_keys;
+
+  // Keep each chunk's basis weights between calls (see SubdivEvaluator::BasisCache): LM calls
+  // operator() and df at the same parameters.  Entries are
+  // by position in point_order, so a point whose neighbours in the order moved past it misses.
+  // Costs 3 * 16 floats per point, or 3 * 20 with Gregory patches.
+  bool cache_basis;
+  std::vector<SubdivEvaluator::BasisCache> basis_caches;
+
+  // Threads for the QR's left blocks (see SchurlikeQR), whose result doesn't depend on it
+  int qr_threads;
+
+  // Active set state, per point: whether it's frozen, and its squared residual at the last df
+  std::vector<char> frozen;
+  VectorX last_residual2;
+  int num_df;
+  // Thaw all points and forget their residuals, e.g. for new data points
+  void reset_active_set()
+  {
+    Index nPoints = data_points.cols();
+    frozen.assign(nPoints, 0);
+    last_residual2.setConstant(nPoints, std::numeric_limits<Scalar>::infinity());
+    num_df = 0;
+    num_active = nPoints;
+  }
+  // Whether point i, just evaluated at S.col(k), has settled, by last_step's u-step (the one that
+  // brought it here) and its residual
+  bool settled(Index i, Index k)
+  {
+    Scalar r2 = (S.col(k) - data_points.col(i)).squaredNorm();
+    Scalar change = std::abs(r2 - last_residual2[i]);
+    last_residual2[i] = r2;
+    return last_step.size() == 2 * data_points.cols() + 3 * evaluator.topology->nVertices &&
+      last_step.segment<2>(2 * i).squaredNorm() < freeze_du_tol * freeze_du_tol &&
+      change < freeze_residual_tol;
+  }
+  void update_point_order(const InputType& x)
+  {
+    if (reorder_points)
+      SubdivEvaluator::patch_order_permutation(x.us, &point_order, &point_order_keys);
+    else if (point_order.size() != x.us.size()) {
+      point_order.resize(x.us.size());
+      for (size_t i = 0; i < point_order.size(); ++i)
+        point_order[i] = int(i);
+    }
+  }
+
+  // Evaluate the surface at points point_order[begin, begin+n) into the chunk workspaces.  The
+  // derivatives (and dSdX's row indices) are relative to begin.  Columns from n to the chunk size
+  // are padding.  dSdu and dSdv are skipped unless uv_derivatives.
+  void evaluate_chunk(const InputType& x, Index begin, Index n, bool derivatives, bool uv_derivatives = true)
+  {
+    Index chunk = chunk_size();
+    chunk_us.resize(chunk);
+    for (Index k = 0; k < chunk; ++k)
+      chunk_us[k] = x.us[point_order[begin + std::min(k, n - 1)]];
+
+    // Not for an Osd backend's residuals, as a cache makes the evaluator use the kernels
+    SubdivEvaluator::BasisCache* cache = 0;
+    if (cache_basis && (derivatives || evaluator.backend == SubdivEvaluator::BACKEND_NATIVE)) {
+      size_t c = size_t(begin / chunk_size());
+      if (basis_caches.size() <= c)
+        basis_caches.resize(c + 1);
+      cache = &basis_caches[c];
+    }
+
+    S.resize(3, chunk);
+    if (!derivatives) {
+      evaluator.evaluateSubdivSurface(x.control_vertices, chunk_us, &S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, cache);
+      return;
+    }
+    if (!uv_derivatives) {
+      evaluator.evaluateSubdivSurface(x.control_vertices, chunk_us, &S, &dSdX, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, cache);
+      return;
+    }
+    dSdu.resize(3, chunk);
+    dSdv.resize(3, chunk);
+    evaluator.evaluateSubdivSurface(x.control_vertices, chunk_us, &S, &dSdX, 0, 0, &dSdu, &dSdv, 0, 0, 0, 0, 0, 0, cache);
+  }
+
+  // Functor functions
+  // 1. Evaluate the residuals at x
+  int operator()(const InputType& x, ValueType& fvec) {
+    long long allocations_before = allocation_count();
+    Index nPoints = data_points.cols();
+    update_point_order(x);
+    Index chunk = chunk_size();
+    for (Index begin = 0; begin < nPoints; begin += chunk) {
+      Index n = std::min(chunk, nPoints - begin);
+      evaluate_chunk(x, begin, n, false);
+
+      // Fill residuals
+      for (Index k = 0; k < n; k++) {
+        Index i = point_order[begin + k];
+        fvec.segment(i * 3, 3) = residual_scale(i) * (S.col(k) - data_points.col(i));
+      }
+    }
+
+    allocations += allocation_count() - allocations_before;
+    return 0;
+  }
+
+  // 2. Evaluate jacobian at x
+  int df(const InputType& x, JacobianType& fjac) 
+  {
+    long long allocations_before = allocation_count();
+    Index nPoints = data_points.cols();
+    Index X_base = nPoints * 2;
+    Index ubase = 0;
+
+    jvals.resize(0);
+    update_point_order(x);
+
+    // Thaw all points to recheck them, or keep the frozen ones frozen
+    bool recheck = false;
+    if (use_active_set) {
+      if (Index(frozen.size()) != nPoints)
+        reset_active_set();
+      recheck = ++num_df % recheck_interval == 0;
+      if (recheck)
+        std::fill(frozen.begin(), frozen.end(), 0);
+      num_active = 0;
+    }
+
+    Index chunk = chunk_size();
+    for (Index begin = 0; begin < nPoints; begin += chunk) {
+      Index n = std::min(chunk, nPoints - begin);
+
+      // Evaluate surface at x, with dSdu and dSdv only if the chunk has active points
+      bool any_active = !use_active_set;
+      for (Index k = 0; k < n && !any_active; ++k)
+        any_active = !frozen[point_order[begin + k]];
+      evaluate_chunk(x, begin, n, true, any_active);
+
+      // Freeze the points that have settled
+      if (use_active_set)
+        for (Index k = 0; k < n; ++k) {
+          Index i = point_order[begin + k];
+          if (settled(i, k) && !recheck)
+            frozen[i] = 1;
+          num_active += !frozen[i];
+        }
+
+      // Fill Jacobian columns, straight into the triplets for the whole Jacobian.
+      // 1. Derivatives wrt control vertices.
+      jvals.reserve(jvals.size() + dSdX.size() * 3 + n * 6);
+      for (int j = 0; j < dSdX.size(); ++j) {
+        auto const& triplet = dSdX[j];
+        if (triplet.row() >= n)
+          continue;   // Padding
+        assert(0 <= triplet.row());
+        assert(0 <= triplet.col() && triplet.col() < x.nVertices());
+        Index i = point_order[begin + triplet.row()];
+        Scalar value = residual_scale(i) * triplet.value();
+        jvals.add(3 * i + 0, X_base + triplet.col() * 3 + 0, value);
+        jvals.add(3 * i + 1, X_base + triplet.col() * 3 + 1, value);
+        jvals.add(3 * i + 2, X_base + triplet.col() * 3 + 2, value);
+      }
+
+      // 2. Derivatives wrt correspondences, zero for frozen points
+      for (Index k = 0; k < n; k++) {
+        Index i = point_order[begin + k];
+        if (use_active_set && frozen[i])
+          continue;
+        Scalar scale = residual_scale(i);
+        jvals.add(3 * i + 0, ubase + 2 * i + 0, scale * dSdu(0, k));
+        jvals.add(3 * i + 1, ubase + 2 * i + 0, scale * dSdu(1, k));
+        jvals.add(3 * i + 2, ubase + 2 * i + 0, scale * dSdu(2, k));
+
+        jvals.add(3 * i + 0, ubase + 2 * i + 1, scale * dSdv(0, k));
+        jvals.add(3 * i + 1, ubase + 2 * i + 1, scale * dSdv(1, k));
+        jvals.add(3 * i + 2, ubase + 2 * i + 1, scale * dSdv(2, k));
+      }
+    }
+
+    set_from_triplets(fjac, 3 * nPoints, 2 * nPoints + 3 * x.nVertices(), jvals, &jacobian_scratch);
+    if (use_active_set && verbose)
+      std::cerr << "[active " << num_active << "/" << nPoints << "]";
+
+    allocations += allocation_count() - allocations_before;
+    return 0;
+  }
+
+  void increment_in_place(InputType* x, StepType const& p)
+  {
+    long long allocations_before = allocation_count();
+    Index nPoints = data_points.cols();
+    Index X_base = nPoints * 2;
+    Index ubase = 0;
+
+    // Increment control vertices
+    Index nVertices = x->nVertices();
+
+    assert(p.size() == nVertices * 3 + nPoints * 2);
+    assert(x->us.size() == nPoints);
+
+    last_step = p;
+    Map<VectorX>(x->control_vertices.data(), nVertices * 3) += p.tail(nVertices * 3);
+    
+    // Increment surface correspondences
+    int loopers = 0;
+    int totalhops = 0;
+    for (int i = 0; i < nPoints; ++i) {
+      // A frozen point's step is zero
+      if (use_active_set && Index(frozen.size()) == nPoints && frozen[i])
+        continue;
+      Vector2 du = p.segment<2>(ubase + 2 * i);
+      int nhops = increment_u_crossing_edges(x->control_vertices, x->us[i].face, x->us[i].u, du, &x->us[i].face, &x->us[i].u);
+      if (nhops < 0)
+        ++loopers;
+      totalhops += std::abs(nhops);
+    }
+    if (verbose) {
+      if (loopers > 0)
+        std::cerr << "[" << totalhops / Scalar(nPoints) << " hops, " << loopers << " points looped]";
+      else if (totalhops > 0)
+        std::cerr << "[" << totalhops << "/" << Scalar(nPoints) << " hops]";
+    }
+
+    allocations += allocation_count() - allocations_before;
+    if (increment_hook)
+      increment_hook(*x);
+  }
+
+  // "Mesh walking" to update correspondences, as in Fig 3, Taylor et al, CVPR 2014, "Hand shape.."
+  int increment_u_crossing_edges(Matrix3X const& X, int face, const Vector2& u, const Vector2& du, int* new_face_out, Vector2* new_u_out)
+  {
+    const int MAX_HOPS = 7;
+
+    Scalar u1_old = u[0];
+    Scalar u2_old = u[1];
+    Scalar du1 = du[0];
+    Scalar du2 = du[1];
+    Scalar u1_new = u1_old + du1;
+    Scalar u2_new = u2_old + du2;
+
+    for (int count = 0; ; ++count) {
+      bool crossing = (u1_new < 0.f) || (u1_new > 1.f) || (u2_new < 0.f) || (u2_new > 1.f);
+
+      if (!crossing) {
+        *new_face_out = face;
+        *new_u_out << u1_new, u2_new;
+        return count;
+      }
+
+      //Find the new face	and the coordinates of the crossing point within the old face and the new face
+      int face_new;
+
+      bool face_found = false;
+
+      Scalar dif, aux, u1_cross, u2_cross;
+
+      if (u1_new < 0.f)
+      {
+        dif = u1_old;
+        const Scalar u2t = u2_old - du2*dif / du1;
+        if ((u2t >= 0.f) && (u2t <= 1.f))
+        {
+          face_new = mesh.face_adj(3, face); aux = u2t; face_found = true;
+          u1_cross = 0.f; u2_cross = u2t;
+        }
+      }
+      if ((u1_new > 1.f) && (!face_found))
+      {
+        dif = 1.f - u1_old;
+        const Scalar u2t = u2_old + du2*dif / du1;
+        if ((u2t >= 0.f) && (u2t <= 1.f))
+        {
+          face_new = mesh.face_adj(1, face); aux = 1.f - u2t; face_found = true;
+          u1_cross = 1.f; u2_cross = u2t;
+        }
+      }
+      if ((u2_new < 0.f) && (!face_found))
+      {
+        dif = u2_old;
+        const Scalar u1t = u1_old - du1*dif / du2;
+        if ((u1t >= 0.f) && (u1t <= 1.f))
+        {
+          face_new = mesh.face_adj(0, face); aux = 1.f - u1t; face_found = true;
+          u1_cross = u1t; u2_cross = 0.f;
+        }
+      }
+      if ((u2_new > 1.f) && (!face_found))
+      {
+        dif = 1.f - u2_old;
+        const Scalar u1t = u1_old + du1*dif / du2;
+        if ((u1t >= 0.f) && (u1t <= 1.f))
+        {
+          face_new = mesh.face_adj(2, face); aux = u1t; face_found = true;
+          u1_cross = u1t; u2_cross = 1.f;
+        }
+      }
+      assert(face_found);
+
+      // Find the coordinates of the crossing point as part of the new face, and update u_old (as that will be new u in next iter).
+      unsigned int conf;
+      for (unsigned int f = 0; f < 4; f++)
+        if (mesh.face_adj(f, face_new) == face) { conf = f; }
+
+      switch (conf)
+      {
+      case 0: u1_old = aux; u2_old = 0.f; break;
+      case 1: u1_old = 1.f; u2_old = aux; break;
+      case 2:	u1_old = 1.f - aux; u2_old = 1.f; break;
+      case 3:	u1_old = 0.f; u2_old = 1.f - aux; break;
+      }
+
+      // Evaluate the subdivision surface at the edge (with respect to the original face)
+      hop_us.resize(2);
+      hop_us[0] = { face,{ u1_cross, u2_cross } };
+      hop_us[1] = { face_new, { u1_old, u2_old } };
+      hop_S.resize(3, 2);
+      hop_Su.resize(3, 2);
+      hop_Sv.resize(3, 2);
+      evaluator.evaluateSubdivSurface(X, hop_us, &hop_S, 0, 0, 0, &hop_Su, &hop_Sv);
+
+      Matrix<Scalar, 3, 2> J_Sa;
+      J_Sa.col(0) = hop_Su.col(0);
+      J_Sa.col(1) = hop_Sv.col(0);
+
+      Matrix<Scalar, 3, 2> J_Sb;
+      J_Sb.col(0) = hop_Su.col(1);
+      J_Sb.col(1) = hop_Sv.col(1);
+
+      //Compute the new u increments
+      Vector2 du_remaining; 
+      du_remaining << u1_new - u1_cross, u2_new - u2_cross;
+      Vector3 prod = J_Sa*du_remaining;
+      Matrix22 AtA = J_Sb.transpose()*J_Sb;
+      Vector2 AtB = J_Sb.transpose()*prod;
+
+      //Vector2 du_new = AtA.ldlt().solve(AtB);
+      Vector2  u_incr = AtA.inverse()*AtB;
+
+      du1 = u_incr[0];
+      du2 = u_incr[1];
+
+      if (count == MAX_HOPS) {
+        //std::cerr << "Problem!!! Many jumps between the mesh faces for the update of one correspondence. I remove the remaining u_increment!\n";
+        auto dmax = std::max(du1, du2);
+        Scalar scale = Scalar(0.5 / dmax);
+        *new_face_out = face;
+        //*new_u_out << u1_old + du1 * scale, u2_old + du2 * scale;
+        *new_u_out << 0.5, 0.5;
+
+        assert((*new_u_out)[0] >= 0 && (*new_u_out)[1] <= 1.0 && (*new_u_out)[1] >= 0 && (*new_u_out)[1] <= 1.0);
+        return -count;
+      }
+
+      u1_new = u1_old + du1;
+      u2_new = u2_old + du2;
+      face = face_new;
+    }
+  }
+
+  Scalar estimateNorm(InputType const& x, StepType const& diag)
+  {
+    Index nVertices = x.nVertices();
+    Map<VectorX> xtop{ (Scalar*)x.control_vertices.data(), nVertices * 3 };
+    double total = xtop.cwiseProduct(diag.tail(nVertices*3)).stableNorm();
+    total = total*total;
+    for (int i = 0; i < x.us.size(); ++i) {
+      Vector2 const& u = x.us[i].u;
+      Vector2 di = diag.segment<2>(2 * i);
+      total += u.cwiseProduct(di).squaredNorm();
+    }
+    return Scalar(sqrt(total));
+  }
+
+  // 5. Describe the QR solvers
+  // For generic Jacobian, one might use this Dense QR solver.
+  typedef SparseQR<JacobianType, COLAMDOrdering<int> > GeneralQRSolver;
+
+  // But for optimal performance, declare QRSolver that understands the sparsity structure.
+  // Here it's block-diagonal LHS with dense RHS
+  //
+  // J1 = [J11   0   0 ... 0
+  //         0 J12   0 ... 0
+  //                   ...
+  //         0   0   0 ... J1N];
+  // And 
+  // J = [J1 J2];
+
+  // QR for J1 subblocks is 2x1
+  typedef ColPivHouseholderQR<Matrix<Scalar, 3, 2> > DenseQRSolver3x2;
+
+  // QR for J1 is block diagonal
+  typedef BlockDiagonalSparseQR<JacobianType, DenseQRSolver3x2> LeftSuperBlockSolver;
+
+  // QR for J1'J2 is general dense (faster than general sparse by about 1.5x for n=500K)
+  typedef ColPivHouseholderQR<Matrix<Scalar, Dynamic, Dynamic> > RightSuperBlockSolver;
+
+  // QR for J is concatenation of the above.
+  typedef BlockSparseQR<JacobianType, LeftSuperBlockSolver, RightSuperBlockSolver> SchurlikeQRSolver;
+
+  // Or the same split with closed-form QR of the 3x2 blocks, many at a time, in SchurlikeQR.h.
+  // Its right block goes to RightSuperBlockSolver only for small cages: that 1.5x was measured on
+  // the cube's 8 vertices, and a large cage's right block is mostly zeros and too big to store
+  // dense, so it switches to SparseQR (see SchurlikeQR::RightMode).
+  typedef SchurlikeQR<JacobianType, RightSuperBlockSolver> BlockQR3x2Solver;
+
+  typedef BlockQR3x2Solver QRSolver;
+
+  // And tell the algorithm how to set the QR parameters.
+  void initQRSolver(SchurlikeQRSolver &qr) {
+    // set block size
+    qr.setBlockParams(data_points.cols() * 2);
+    qr.getLeftSolver().setSparseBlockParams(3, 2);
+  }
+  void initQRSolver(BlockQR3x2Solver &qr) {
+    qr.setBlockParams(data_points.cols() * 2);
+    qr.setNumThreads(qr_threads);
+    qr.setWorkspace(&qr_workspace);
+  }
+  // LM makes a QRSolver per iteration; its storage lives here instead, so after the first
+  // iteration it's reused rather than reallocated
+  BlockQR3x2Solver::Workspace qr_workspace;
+};
+
+// LM's choice of damping, by solves that reuse the factorization (see schurlike_lmpar), rather
+// than the generic Givens rotations of the whole of R.  The damping is recorded in the QR's
+// workspace, the functor's qr_workspace, for DeadlineFitter's snapshots.
+namespace Eigen {
+namespace internal {
+template <>
+inline void lmpar2<Subdiv3D_Functor::BlockQR3x2Solver, VectorX>(Subdiv3D_Functor::BlockQR3x2Solver const& qr,
+  VectorX const& diag, VectorX const& qtb, Scalar delta, Scalar& par, VectorX& x)
+{
+  Subdiv3D_Functor::BlockQR3x2Solver::Workspace* ws = qr.workspace();
+  if (ws && ws->lm_resume_par > 0) {
+    par = ws->lm_resume_par;
+    ws->lm_resume_par = 0;
+  }
+  schurlike_lmpar(qr, diag, qtb, delta, par, x);
+  if (ws) {
+    ws->lm_delta = delta;
+    ws->lm_par = par;
+  }
+}
+}
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
 #include <Eigen/Eigen>
 
 #include <iso646.h> //To define the words and, not, etc. as operators in Windows
@@ -7,6 +11,13 @@
 #include <opensubdiv/far/stencilTableFactory.h>
 #include <opensubdiv/osd/cpuEvaluator.h>
 #include <opensubdiv/osd/cpuVertexBuffer.h>
+#include <opensubdiv/osd/types.h>
+#ifdef OPENSUBDIV_HAS_OPENMP
+#include <opensubdiv/osd/ompEvaluator.h>
+#endif
+#ifdef OPENSUBDIV_HAS_TBB
+#include <opensubdiv/osd/tbbEvaluator.h>
+#endif
 #include <opensubdiv/far/primvarRefiner.h>
 #include <opensubdiv/far/patchTableFactory.h>
 #include <opensubdiv/far/patchMap.h>
@@ -16,10 +27,11 @@
 #include "eigen_extras.h"
 
 #include "MeshTopology.h"
+#include "SubdivTopology.h"
 
 using namespace OpenSubdiv;
 
-#define MAX_NUM_W  16		//If using ENDCAP_BSPLINE_BASIS
+#define MAX_NUM_W  20		//Gregory basis patches; regular ones have 16
 
 // Vertex container implementation for OSD
 struct OSD_Vertex {
@@ -52,18 +64,75 @@ struct SurfacePoint {
 struct SubdivEvaluator {
   typedef Eigen::TripletArray<Scalar> triplets_t;
 
-  OpenSubdiv::Far::PatchTable *patchTable;
-
-  size_t  nVertices;
-  size_t  nRefinerVertices;
-  size_t  nLocalPoints;
+  // Topology-derived tables, immutable and shared between evaluators (and threads).
+  std::shared_ptr<SubdivTopology const> topology;
 
+  // Per-evaluator buffer for the control vertices and local points, so each thread needs its own copy.
   mutable std::vector<OSD_Vertex> evaluation_verts_buffer;
-  static const int maxlevel = 3;
-  Far::TopologyRefiner * refiner2;
-  void generate_refined_mesh(Matrix3X const& vert_coords, int levels, MeshTopology* mesh_out, Matrix3X* verts_out);
 
-  SubdivEvaluator(MeshTopology const& mesh);
+  // Evaluate points in patch order rather than input order, so consecutive points reuse the
+  // same CVs and nearby cache lines.  Outputs are still in input order.  Off by default, as
+  // callers like Subdiv3D_Functor already pass points in that order.
+  bool patch_order;
+  mutable std::vector<int> order_buffer;
+  typedef std::vector<std::pair<uint64_t, int> > OrderKeys;
+  mutable OrderKeys order_keys;
+
+  // Which code evaluates the patches: the kernels below, or OpenSubdiv's batched Osd evaluators,
+  // which take all the points' patch coordinates at once and work in single precision, on one
+  // thread, or with OpenMP or TBB when OpenSubdiv is built with them.  The Osd backends compute
+  // S, Su, Sv and N; calls for Jacobians or second derivatives or with a basis cache, and
+  // topologies loaded from a cache file, which have no Far::PatchTable, use the kernels
+  // whatever the backend.  So Subdiv3D_Functor's residuals use the backend, and its Jacobian the
+  // kernels.  Without OpenMP or TBB, their backends run the Osd CPU evaluator (see backend_available).
+  enum Backend { BACKEND_NATIVE, BACKEND_OSD_CPU, BACKEND_OSD_OMP, BACKEND_OSD_TBB };
+  Backend backend;
+  static bool backend_available(Backend backend);
+  static char const* backend_name(Backend backend);
+
+  // Basis weights (position and first derivatives) of the points of a previous call, so a
+  // call at the same points, e.g. df after operator() at the same LM parameters, or a
+  // later iteration for points that haven't moved, only redoes the sums over the CVs.
+  // Entry i is for keys[i], and is recomputed whenever uv[i] differs from it.  Used only when
+  // no second derivatives are asked for.
+  struct BasisCache {
+    std::vector<SurfacePoint> keys;
+    std::vector<float> weights;   // 3 * topology->patch_stride per point
+    size_t hits = 0;
+    size_t misses = 0;
+  };
+
+  // The surface at fixed points, kept up to date as control vertices move, for interactive
+  // edits that drag a few at a time.  initSurfaceCache evaluates it in full; updateSurfaceCache
+  // finds the vertices that moved, the stencil points and patches they move, and adds the change
+  // to S, Su and Sv at the points on those patches only, from the basis weights kept in basis.
+  struct SurfaceCache {
+    std::vector<SurfacePoint> uv;
+    Matrix3X X;                  // The control vertices S, Su and Sv are for
+    Matrix3X S, Su, Sv;
+    BasisCache basis;
+    std::vector<int> patch_point_offsets;   // The points on each patch, in CSR form
+    std::vector<int> patch_points;
+    size_t num_updated = 0;      // Points re-evaluated by the last update
+
+    // Scratch for updates: moves of the cage vertices and stencil points, zero but for the
+    // dirty ones, and the dirty patches
+    std::vector<Vector3> delta;
+    std::vector<int> dirty_points;
+    std::vector<char> patch_dirty;
+    std::vector<int> dirty_patches;
+  };
+
+  // The order of the points in uv sorted by face, then by Morton code of (u,v) within the face.
+  // keys is scratch, which callers may keep between calls to avoid reallocating it.
+  static void patch_order_permutation(std::vector<SurfacePoint> const& uv, std::vector<int>* order, OrderKeys* keys = 0);
+
+  void generate_refined_mesh(Matrix3X const& vert_coords, int levels, MeshTopology* mesh_out, Matrix3X* verts_out) const;
+
+  // Construction is cheap for topologies already seen: see SubdivTopology::get
+  SubdivEvaluator(MeshTopology const& mesh, SubdivTopology::Options const& options = SubdivTopology::Options());
+  SubdivEvaluator(std::shared_ptr<SubdivTopology const> const& topology);
+
   void evaluateSubdivSurface(Matrix3X const& vert_coords,
     std::vector<SurfacePoint> const& uv,
     Matrix3X* out_S,
@@ -77,91 +146,150 @@ struct SubdivEvaluator {
     Matrix3X* out_Svv = 0,
     Matrix3X* out_N = 0,
     Matrix3X* out_Nu = 0,
-    Matrix3X* out_Nv = 0) const;
-
-  SubdivEvaluator(SubdivEvaluator const& that) {
-    *this = that;
-  }
-
-  SubdivEvaluator& operator=(SubdivEvaluator const& that) {
-    this->nVertices = that.nVertices;
-    this->nRefinerVertices = that.nRefinerVertices;
-    this->nLocalPoints = that.nLocalPoints;
-    this->patchTable = new OpenSubdiv::Far::PatchTable(*that.patchTable);
-    this->evaluation_verts_buffer = that.evaluation_verts_buffer;
-    return *this;
-  }
-
-  ~SubdivEvaluator() {
-    delete patchTable;
-
-    // xxawf delete refiner2
-  }
-
+    Matrix3X* out_Nv = 0,
+    BasisCache* basis_cache = 0) const;
+
+  void initSurfaceCache(Matrix3X const& vert_coords, std::vector<SurfacePoint> const& uv, SurfaceCache* cache) const;
+  // Bring cache to vert_coords.  Returns the number of points re-evaluated.  When many
+  // vertices move, it is cheaper to start over, which this does.
+  size_t updateSurfaceCache(Matrix3X const& vert_coords, SurfaceCache* cache) const;
+
+  // Outputs of a kernel, as bits of a compile-time mask.  S is always computed.
+  enum {
+    EVAL_FIRST = 1,     // Su and Sv
+    EVAL_DSDX = 2,      // Any of dSdX, dSudX, dSvdX
+    EVAL_SECOND = 4,    // Any of Suu, Suv, Svv
+    EVAL_NORMALS = 8    // N, which needs EVAL_FIRST
+  };
+
+  struct Outputs {
+    Matrix3X *S, *Su, *Sv, *Suu, *Suv, *Svv, *N;
+    triplets_t *dSdX, *dSudX, *dSvdX;
+    BasisCache* basis_cache;
+  };
+
+  // The kernel for one set of outputs, with no per-point tests of what to compute beyond
+  // which of the outputs within a Mask bit are wanted.  evaluateSubdivSurface picks the kernel
+  // from the pointers it is given.
+  template <int Mask>
+  void evaluate(Matrix3X const& vert_coords, std::vector<SurfacePoint> const& uv, Outputs const& out) const;
+
+private:
+  template <int Mask, int N>
+  void evaluate_points(std::vector<SurfacePoint> const& uv, Outputs const& out) const;
+  void evaluate_basis(int patch, Scalar u, Scalar v, float* wP, float* wDs, float* wDt, float* wDss, float* wDst, float* wDtt) const;
+
+  // The Osd backends' evaluation of S, Su and Sv, from flat float buffers
+  void evaluate_osd(Matrix3X const& vert_coords, std::vector<SurfacePoint> const& uv, Outputs const& out) const;
+  struct OsdBuffer {
+    std::vector<float> data;
+    float* BindCpuBuffer() { return data.data(); }
+  };
+  struct OsdPatchCoords {
+    std::vector<Osd::PatchCoord> coords;
+    Osd::PatchCoord* BindCpuBuffer() { return coords.data(); }
+  };
+  mutable OsdBuffer osd_src, osd_S, osd_Su, osd_Sv;
+  mutable OsdPatchCoords osd_coords;
+
+  // Checks, stencil points, and clearing and sizing of the outputs, before the kernel's loop
+  void prepare(Matrix3X const& vert_coords, std::vector<SurfacePoint> const& uv, Outputs const& out) const;
+  // Point i's triplets of dSdX, dSudX and dSvdX
+  void add_dSdX(int i, Far::Index const* cvs, int ncvs, float const* pWeights, float const* dsWeights, float const* dtWeights, Outputs const& out) const;
+
+  // Scratch for add_dSdX: weight sums (position, d/du, d/dv) per cage vertex, zero but for the
+  // vertices of the current point, which are listed in dX_vertices and flagged in dX_touched.
+  mutable Matrix3X dX_weights;
+  mutable std::vector<char> dX_touched;
+  mutable std::vector<Far::Index> dX_vertices;
 };
 
-SubdivEvaluator::SubdivEvaluator(MeshTopology const& mesh)
+SubdivEvaluator::SubdivEvaluator(MeshTopology const& mesh, SubdivTopology::Options const& options) :
+  SubdivEvaluator(SubdivTopology::get(mesh, options))
 {
-  nVertices = mesh.num_vertices;
-
-  size_t  num_faces = mesh.num_faces();
-
-  //Fill the topology of the mesh
-  Far::TopologyDescriptor desc;
-  desc.numVertices = (int) mesh.num_vertices;
-  desc.numFaces = (int) num_faces;
-
-  Eigen::VectorXi vertsperface((int) num_faces);
-  vertsperface.setConstant((int) mesh.quads.rows());
-
-  desc.numVertsPerFace = vertsperface.data();
-  desc.vertIndicesPerFace = mesh.quads.data();
-
-  //Instantiate a FarTopologyRefiner from the descriptor.
-  Sdc::SchemeType type = OpenSubdiv::Sdc::SCHEME_CATMARK;
-  // Adpative refinement is only supported for CATMARK
-  // Scheme LOOP is only supported if the mesh is purely composed of triangles
-
-  Sdc::Options options;
-  options.SetVtxBoundaryInterpolation(Sdc::Options::VTX_BOUNDARY_NONE);
-  typedef Far::TopologyRefinerFactory<Far::TopologyDescriptor> Refinery;
-  OpenSubdiv::Far::TopologyRefiner *refiner = Refinery::Create(desc, Refinery::Options(type, options));
-
-  const int maxIsolation = 0; //Don't change it!
-  refiner->RefineAdaptive(Far::TopologyRefiner::AdaptiveOptions(maxIsolation));
-
-  // Generate a set of Far::PatchTable that we will use to evaluate the surface limit
-  Far::PatchTableFactory::Options patchOptions;
-  patchOptions.endCapType = Far::PatchTableFactory::Options::ENDCAP_BSPLINE_BASIS;
+}
 
-  patchTable = Far::PatchTableFactory::Create(*refiner, patchOptions);
+SubdivEvaluator::SubdivEvaluator(std::shared_ptr<SubdivTopology const> const& topology) :
+  topology(topology),
+  // A buffer to hold the position of the refined verts and local points.
+  evaluation_verts_buffer(topology->nRefinerVertices + topology->nLocalPoints),
+  patch_order(false),
+  backend(BACKEND_NATIVE)
+{
+}
 
-  // Compute the total number of points we need to evaluate patchtable.
-  // we use local points around extraordinary features.
-  nRefinerVertices = refiner->GetNumVerticesTotal();
-  nLocalPoints = patchTable->GetNumLocalPoints();
+bool SubdivEvaluator::backend_available(Backend backend)
+{
+  switch (backend) {
+  case BACKEND_NATIVE:
+  case BACKEND_OSD_CPU:
+    return true;
+  case BACKEND_OSD_OMP:
+#ifdef OPENSUBDIV_HAS_OPENMP
+    return true;
+#else
+    return false;
+#endif
+  case BACKEND_OSD_TBB:
+#ifdef OPENSUBDIV_HAS_TBB
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
 
-  // Create a buffer to hold the position of the refined verts and
-  // local points.
-  evaluation_verts_buffer.resize(nRefinerVertices + nLocalPoints);
+char const* SubdivEvaluator::backend_name(Backend backend)
+{
+  switch (backend) {
+  case BACKEND_NATIVE: return "native";
+  case BACKEND_OSD_CPU: return "Osd CPU";
+  case BACKEND_OSD_OMP: return "Osd OpenMP";
+  case BACKEND_OSD_TBB: return "Osd TBB";
+  }
+  return "?";
+}
 
-  // xxaqwf delete refiner here?
+// Interleave the bits of 16-bit x and y
+inline uint32_t morton2d(uint32_t x, uint32_t y)
+{
+  auto spread = [](uint32_t a) {
+    a = (a | (a << 8)) & 0x00ff00ff;
+    a = (a | (a << 4)) & 0x0f0f0f0f;
+    a = (a | (a << 2)) & 0x33333333;
+    a = (a | (a << 1)) & 0x55555555;
+    return a;
+  };
+  return spread(x) | (spread(y) << 1);
+}
 
-  // This refiner is to generate subdivided meshes
-  // Instantiate a FarTopologyRefiner from the descriptor
-  this->refiner2 = Refinery::Create(desc, Refinery::Options(type, options));
+void SubdivEvaluator::patch_order_permutation(std::vector<SurfacePoint> const& uv, std::vector<int>* order, OrderKeys* keys_scratch)
+{
+  OrderKeys local_keys;
+  OrderKeys& keys = keys_scratch ? *keys_scratch : local_keys;
+  keys.resize(uv.size());
+  for (size_t i = 0; i < uv.size(); ++i) {
+    uint32_t u = uint32_t(std::min(std::max(uv[i].u[0], Scalar(0)), Scalar(1)) * 65535);
+    uint32_t v = uint32_t(std::min(std::max(uv[i].u[1], Scalar(0)), Scalar(1)) * 65535);
+    keys[i] = std::make_pair((uint64_t(uint32_t(uv[i].face)) << 32) | morton2d(u, v), int(i));
+  }
+  std::sort(keys.begin(), keys.end());
 
-  // Uniformly refine the topolgy up to 'maxlevel'
-  refiner2->RefineUniform(Far::TopologyRefiner::UniformOptions(maxlevel));
+  order->resize(uv.size());
+  for (size_t k = 0; k < keys.size(); ++k)
+    (*order)[k] = keys[k].second;
 }
 
-void SubdivEvaluator::generate_refined_mesh(Matrix3X const& vert_coords, int levels, MeshTopology* mesh_out, Matrix3X* verts_out)
+void SubdivEvaluator::generate_refined_mesh(Matrix3X const& vert_coords, int levels, MeshTopology* mesh_out, Matrix3X* verts_out) const
 {
-  if (levels > maxlevel) {
+  if (levels > SubdivTopology::maxlevel) {
     std::cerr << "SubdivEvaluator::generate_refined_mesh: level too high\n";
-    levels = maxlevel;
+    levels = SubdivTopology::maxlevel;
   }
 
+  Far::TopologyRefiner const* refiner2 = &topology->uniform_refiner();
+
   // Allocate a buffer for vertex primvar data. The buffer length is set to
   // be the sum of all children vertices up to the highest level of refinement.
   std::vector<OSD_Vertex> vbuffer(refiner2->GetNumVerticesTotal());
@@ -212,6 +340,67 @@ void SubdivEvaluator::generate_refined_mesh(Matrix3X const& vert_coords, int lev
   mesh_out->update_adjacencies();
 }
 
+// Cubic B-spline basis at t, and its first and second derivatives
+inline void bspline_weights_1d(float t, float w[4], float dw[4], float ddw[4])
+{
+  float t2 = t*t, t3 = t2*t;
+  w[0] = (1.0f - 3.0f*(t - t2) - t3) / 6.0f;
+  w[1] = (4.0f - 6.0f*t2 + 3.0f*t3) / 6.0f;
+  w[2] = (1.0f + 3.0f*(t + t2 - t3)) / 6.0f;
+  w[3] = t3 / 6.0f;
+
+  dw[0] = -0.5f*t2 + t - 0.5f;
+  dw[1] = 1.5f*t2 - 2.0f*t;
+  dw[2] = -1.5f*t2 + t + 0.5f;
+  dw[3] = 0.5f*t2;
+
+  ddw[0] = 1.0f - t;
+  ddw[1] = 3.0f*t - 2.0f;
+  ddw[2] = 1.0f - 3.0f*t;
+  ddw[3] = t;
+}
+
+// Weights of the 16 CVs of a regular patch at face coordinates (u,v), and their derivatives.
+// Same as Far::PatchTable::EvaluateBasis for REGULAR patches (and same argument order), but needs only the
+// PatchParam, so it also works on topologies loaded from a cache file.  Second derivative
+// outputs may be null.
+inline void evaluateBSplineBasis(Far::PatchParam const& param, Scalar u, Scalar v,
+  float wP[16], float wDs[16], float wDt[16], float wDss[16], float wDst[16], float wDtt[16])
+{
+  float s = float(u), t = float(v);
+  param.Normalize(s, t);
+
+  float sW[4], dsW[4], dssW[4], tW[4], dtW[4], dttW[4];
+  bspline_weights_1d(s, sW, dsW, dssW);
+  bspline_weights_1d(t, tW, dtW, dttW);
+
+  // d/du of the patch's parameter, which covers a fraction of the face
+  float d = 1.0f / param.GetParamFraction();
+  for (int i = 0, k = 0; i < 4; ++i)
+    for (int j = 0; j < 4; ++j, ++k) {
+      wP[k] = sW[j] * tW[i];
+      wDs[k] = dsW[j] * tW[i] * d;
+      wDt[k] = sW[j] * dtW[i] * d;
+      if (wDss) wDss[k] = dssW[j] * tW[i] * d * d;
+      if (wDst) wDst[k] = dsW[j] * dtW[i] * d * d;
+      if (wDtt) wDtt[k] = sW[j] * dttW[i] * d * d;
+    }
+
+  // On boundary edges the missing row of CVs is the reflection of the interior one through
+  // the edge: fold its weights onto them, and clear its own.
+  int boundary = param.GetBoundary();
+  if (boundary) {
+    float* weights[6] = { wP, wDs, wDt, wDss, wDst, wDtt };
+    for (float* w : weights) {
+      if (!w) continue;
+      if (boundary & 1) for (int i = 0; i < 4; ++i) { w[i + 8] -= w[i]; w[i + 4] += 2 * w[i]; w[i] = 0; }
+      if (boundary & 2) for (int i = 0; i < 16; i += 4) { w[i + 1] -= w[i + 3]; w[i + 2] += 2 * w[i + 3]; w[i + 3] = 0; }
+      if (boundary & 4) for (int i = 0; i < 4; ++i) { w[i + 4] -= w[i + 12]; w[i + 8] += 2 * w[i + 12]; w[i + 12] = 0; }
+      if (boundary & 8) for (int i = 0; i < 16; i += 4) { w[i + 2] -= w[i]; w[i + 1] += 2 * w[i]; w[i] = 0; }
+    }
+  }
+}
+
 void SubdivEvaluator::evaluateSubdivSurface(Matrix3X const& vert_coords,
   std::vector<SurfacePoint> const& uv,
   Matrix3X* out_S,
@@ -225,20 +414,9 @@ void SubdivEvaluator::evaluateSubdivSurface(Matrix3X const& vert_coords,
   Matrix3X* out_Svv,
   Matrix3X* out_N,
   Matrix3X* out_Nu,
-  Matrix3X* out_Nv) const
+  Matrix3X* out_Nv,
+  BasisCache* basis_cache) const
 {
-  // Check it's the same size vertex array
-  assert(vert_coords.cols() == nVertices);
-  // Check output size matches input
-  assert(uv.size() == out_S->cols());
-  assert(!out_Su || (uv.size() == out_Su->cols()));
-  assert(!out_Sv || (uv.size() == out_Sv->cols()));
-  assert(!out_Suu || (uv.size() == out_Suu->cols()));
-  assert(!out_Suv || (uv.size() == out_Suv->cols()));
-  assert(!out_Svv || (uv.size() == out_Svv->cols()));
-  // Check that we can use raw pointers as iterators over the evaluation_verts
-  //assert((uint8_t*) &evaluation_verts_buffer[1] - (uint8_t*) &evaluation_verts_buffer[0] == 12);
-
   if (0) {
     for (int i = 0; i < uv.size(); ++i) {
       out_S->col(i)[0] = uv[i].u[0];
@@ -259,155 +437,429 @@ void SubdivEvaluator::evaluateSubdivSurface(Matrix3X const& vert_coords,
     return;
   }
 
+  assert(!out_Nu && !out_Nv); // unimplemented
+  assert(!out_N || (out_Su && out_Sv));
+
+  // The kernels compute Su and Sv together
+  Matrix3X missing;
+  if (!out_Su != !out_Sv) {
+    missing.resize(3, uv.size());
+    if (!out_Su) out_Su = &missing;
+    if (!out_Sv) out_Sv = &missing;
+  }
+
+  Outputs out = { out_S, out_Su, out_Sv, out_Suu, out_Suv, out_Svv, out_N, out_dSdX, out_dSudX, out_dSvdX, basis_cache };
+  int mask =
+    (out_Su ? EVAL_FIRST : 0) |
+    (out_dSdX || out_dSudX || out_dSvdX ? EVAL_DSDX : 0) |
+    (out_Suu || out_Suv || out_Svv ? EVAL_SECOND : 0) |
+    (out_N ? EVAL_NORMALS : 0);
+
+  // The Osd backends only do plain evaluation: with a basis cache, which they can't fill, the
+  // kernels run, so the cache and its users (e.g. initSurfaceCache) see the same weights
+  if (backend != BACKEND_NATIVE && !(mask & (EVAL_DSDX | EVAL_SECOND)) && !basis_cache && topology->osd_patch_table()) {
+    evaluate_osd(vert_coords, uv, out);
+    return;
+  }
+
+  switch (mask) {
+#define CASE(MASK) case MASK: evaluate<MASK>(vert_coords, uv, out); break;
+    CASE(0) CASE(1) CASE(2) CASE(3) CASE(4) CASE(5) CASE(6) CASE(7)
+    CASE(8) CASE(9) CASE(10) CASE(11) CASE(12) CASE(13) CASE(14) CASE(15)
+#undef CASE
+  }
+}
+
+void SubdivEvaluator::prepare(Matrix3X const& vert_coords, std::vector<SurfacePoint> const& uv, Outputs const& out) const
+{
+  // Check it's the same size vertex array
+  assert(vert_coords.cols() == topology->nVertices);
+  // Check output size matches input
+  assert(uv.size() == out.S->cols());
+  assert(!out.Su || (uv.size() == out.Su->cols()));
+  assert(!out.Sv || (uv.size() == out.Sv->cols()));
+  assert(!out.Suu || (uv.size() == out.Suu->cols()));
+  assert(!out.Suv || (uv.size() == out.Suv->cols()));
+  assert(!out.Svv || (uv.size() == out.Svv->cols()));
+  assert(!out.N || (uv.size() == out.N->cols()));
+
+  size_t nVertices = topology->nVertices;
+  // The local point stencils
+  int const* st_offsets = topology->stencil_offsets.data();
+  Far::Index const* st_indices = topology->stencil_indices.data();
+  float const* st_weights = topology->stencil_weights.data();
+
   // then copy the coarse positions at the beginning from vert_coords
   for (size_t i = 0; i < nVertices; ++i)
     evaluation_verts_buffer[i].point = vert_coords.col(i);
 
-  // Evaluate local points from interpolated vertex primvars.
-  int numStencils = patchTable->GetLocalPointStencilTable()->GetNumStencils();
-
-  patchTable->ComputeLocalPointValues(&evaluation_verts_buffer[0], &evaluation_verts_buffer[nRefinerVertices]);
-
-  //Get all the stencils from the patchTable (necessary to obtain the weights for the gradients)
-  //--------------------------------------------------------------------------------------------------
-  Far::StencilTable const *stenciltab = patchTable->GetLocalPointStencilTable();
-  size_t  nstencils = stenciltab->GetNumStencils();
-  // printf("\n Num of stencils - %d", nstencils);
-  std::vector<Far::Stencil> st(nstencils);
-
-  for (size_t i = 0; i < nstencils; i++)
-  {
-    st[i] = stenciltab->GetStencil(Far::Index(i));
-    if (0) {
-      unsigned int size_st = st[i].GetSize();
-      Far::Index const *ind = st[i].GetVertexIndices();
-      float const *wei = st[i].GetWeights();
-      printf("\n Stencil %zd: ", i);
-      for (unsigned int i = 0; i < size_st; i++)
-        printf("V=%d, W=%0.3f ,", ind[i], wei[i]);
+  // Evaluate the isolation levels' vertices and the local points from the cage
+  OSD_Vertex* stencil_points = &evaluation_verts_buffer[nVertices];
+  for (size_t i = 0; i + 1 < topology->stencil_offsets.size(); ++i) {
+    Vector3 p = Vector3::Zero();
+    for (int k = st_offsets[i]; k < st_offsets[i + 1]; ++k)
+      p += st_weights[k] * evaluation_verts_buffer[st_indices[k]].point;
+    stencil_points[i].point = p;
+  }
+
+  // Preallocate triplet vectors to max feasibly needed
+#define CLEAR(VAR)\
+  if (VAR) {\
+    VAR->reserve(MAX_NUM_W*uv.size());\
+    VAR->resize(0);\
+  }
+  CLEAR(out.dSdX);
+  CLEAR(out.dSudX);
+  CLEAR(out.dSvdX);
+#undef CLEAR
+
+  if (out.dSdX || out.dSudX || out.dSvdX) {
+    if (dX_weights.cols() != Eigen::Index(nVertices)) {
+      dX_weights.setZero(3, nVertices);
+      dX_touched.assign(nVertices, 0);
     }
+    dX_vertices.reserve(4 * MAX_NUM_W);
+  }
+
+  if (patch_order)
+    patch_order_permutation(uv, &order_buffer, &order_keys);
+
+  if (out.basis_cache && out.basis_cache->keys.size() != uv.size()) {
+    SurfacePoint none = { -1, Vector2::Zero() };
+    out.basis_cache->keys.assign(uv.size(), none);
+    out.basis_cache->weights.resize(uv.size() * 3 * topology->patch_stride);
+  }
+}
+
+template <int Mask>
+void SubdivEvaluator::evaluate(Matrix3X const& vert_coords, std::vector<SurfacePoint> const& uv, Outputs const& out) const
+{
+  prepare(vert_coords, uv, out);
+  if (topology->patch_stride == SubdivTopology::regular_patch_size)
+    evaluate_points<Mask, SubdivTopology::regular_patch_size>(uv, out);
+  else
+    evaluate_points<Mask, SubdivTopology::max_patch_size>(uv, out);
+}
+
+void SubdivEvaluator::evaluate_osd(Matrix3X const& vert_coords, std::vector<SurfacePoint> const& uv, Outputs const& out) const
+{
+  prepare(vert_coords, uv, out);
+
+  // Cage vertices and stencil points, in the order patchTable indexes them
+  size_t nPoints = evaluation_verts_buffer.size();
+  osd_src.data.resize(3 * nPoints);
+  for (size_t i = 0; i < nPoints; ++i)
+    for (int d = 0; d < 3; ++d)
+      osd_src.data[3 * i + d] = float(evaluation_verts_buffer[i].point[d]);
+
+  int n = int(uv.size());
+  osd_coords.coords.resize(n);
+  // In patch order if asked for, as the kernels do: prepare has made order_buffer
+  auto point = [&](int k) { return patch_order ? order_buffer[k] : k; };
+  for (int k = 0; k < n; ++k) {
+    int i = point(k);
+    Far::PatchTable::PatchHandle const* handle = topology->patchMap->FindPatch(uv[i].face, uv[i].u[0], uv[i].u[1]);
+    assert(handle);
+    osd_coords.coords[k] = Osd::PatchCoord(*handle, float(uv[i].u[0]), float(uv[i].u[1]));
+  }
+
+  bool first = out.Su != 0;
+  osd_S.data.resize(3 * n);
+  if (first) {
+    osd_Su.data.resize(3 * n);
+    osd_Sv.data.resize(3 * n);
+  }
+
+  Osd::BufferDescriptor desc(0, 3, 3);
+  Osd::CpuPatchTable const* patches = topology->osd_patch_table();
+  bool ok = false;
+#define EVAL(EVALUATOR) \
+  ok = first ? \
+    EVALUATOR::EvalPatches(&osd_src, desc, &osd_S, desc, &osd_Su, desc, &osd_Sv, desc, n, &osd_coords, patches) : \
+    EVALUATOR::EvalPatches(&osd_src, desc, &osd_S, desc, n, &osd_coords, patches);
+  switch (backend) {
+#ifdef OPENSUBDIV_HAS_OPENMP
+  case BACKEND_OSD_OMP: EVAL(Osd::OmpEvaluator) break;
+#endif
+#ifdef OPENSUBDIV_HAS_TBB
+  case BACKEND_OSD_TBB: EVAL(Osd::TbbEvaluator) break;
+#endif
+  default: EVAL(Osd::CpuEvaluator) break;
+  }
+#undef EVAL
+  assert(ok);
+  (void)ok;
+
+  for (int k = 0; k < n; ++k) {
+    int i = point(k);
+    out.S->col(i) = Eigen::Map<Eigen::Vector3f>(&osd_S.data[3 * k]).cast<Scalar>();
+    if (!first)
+      continue;
+    out.Su->col(i) = Eigen::Map<Eigen::Vector3f>(&osd_Su.data[3 * k]).cast<Scalar>();
+    out.Sv->col(i) = Eigen::Map<Eigen::Vector3f>(&osd_Sv.data[3 * k]).cast<Scalar>();
+    if (out.N)
+      out.N->col(i) = out.Su->col(i).cross(out.Sv->col(i));
   }
+}
+
+// Basis weights of the patch at (u,v).  Second derivative outputs may be null.
+void SubdivEvaluator::evaluate_basis(int patch, Scalar u, Scalar v, float* wP, float* wDs, float* wDt, float* wDss, float* wDst, float* wDtt) const
+{
+  if (topology->is_gregory(patch))
+    topology->patchTable->EvaluateBasis(topology->gregory_handles[patch], float(u), float(v), wP, wDs, wDt, wDss, wDst, wDtt);
+  else
+    evaluateBSplineBasis(topology->patch_params[patch], u, v, wP, wDs, wDt, wDss, wDst, wDtt);
+}
 
-  // Create a Far::PatchMap to help locating patches in the table
-  Far::PatchMap patchmap(*patchTable);
-  //Far::PtexIndices ptexIndices(*refiner);  // Far::PtexIndices helps to find indices of ptex faces.
+// The loop over points, for patches of up to N CVs.  Smaller patches' CVs are padded with
+// zero points, so the products stay fixed-size.
+template <int Mask, int N>
+void SubdivEvaluator::evaluate_points(std::vector<SurfacePoint> const& uv, Outputs const& out) const
+{
+  typedef Eigen::Map<Eigen::Matrix<float, N, 1> > Weights;
 
   float
-    pWeights[MAX_NUM_W],
-    dsWeights[MAX_NUM_W],
-    dtWeights[MAX_NUM_W],
+    pBuffer[MAX_NUM_W],
+    dsBuffer[MAX_NUM_W],
+    dtBuffer[MAX_NUM_W],
     dssWeights[MAX_NUM_W],
     dttWeights[MAX_NUM_W],
     dstWeights[MAX_NUM_W];
 
-  // Zero the output arrays
-  if (out_S) out_S->setZero();
-  if (out_Su) out_Su->setZero();
-  if (out_Sv) out_Sv->setZero();
-  if (out_Suu) out_Suu->setZero();
-  if (out_Suv) out_Suv->setZero();
-  if (out_Svv) out_Svv->setZero();
-  if (out_N) out_N->setZero();
-  if (out_Nu) out_Nu->setZero();
-  if (out_Nv) out_Nv->setZero();
+  // The basis cache holds no second derivative weights
+  BasisCache* cache = (Mask & EVAL_SECOND) ? 0 : out.basis_cache;
 
-  // Preallocate triplet vectors to max feasibly needed
-#define CLEAR(VAR)\
-  if (VAR) {\
-    VAR->reserve(MAX_NUM_W*uv.size());\
-    VAR->resize(0);\
-  }
-  CLEAR(out_dSdX);
-  CLEAR(out_dSudX);
-  CLEAR(out_dSvdX);
-#undef CLEAR
+  // The CVs of the last patch evaluated, which the next point reuses if it's on the same patch
+  Eigen::Matrix<Scalar, 3, N> cv_points = Eigen::Matrix<Scalar, 3, N>::Zero();
+  int gathered_patch = -1;
 
   //Evaluate the surface with parametric coordinates
-  for (unsigned int i = 0; i < uv.size(); ++i) {
+  for (unsigned int k = 0; k < uv.size(); ++k) {
+    unsigned int i = patch_order ? order_buffer[k] : k;
     int face = uv[i].face;
     Scalar u = uv[i].u[0];
     Scalar v = uv[i].u[1];
 
-    // Locate the patch corresponding to the face ptex idx and (s,t)
-    Far::PatchTable::PatchHandle const * handle = patchmap.FindPatch(face, u, v);
-    assert(handle);
-
-    // Evaluate the patch weights, identify the CVs and compute the limit frame:
-    patchTable->EvaluateBasis(*handle, u, v, pWeights, dsWeights, dtWeights,
-      out_Suu ? dssWeights : 0, out_Svv ? dttWeights : 0, out_Suv ? dstWeights : 0);
-
-    Far::ConstIndexArray cvs = patchTable->GetPatchVertices(*handle);
-    for (int cv = 0; cv < cvs.size(); ++cv) {
-#define UPDATE(var, weight)\
-      if (var) var->col(i) += evaluation_verts_buffer[cvs[cv]].point * weight ## Weights[cv];
-      UPDATE(out_S, p);
-      UPDATE(out_Su, ds);
-      UPDATE(out_Sv, dt);
-      UPDATE(out_Suu, dss);
-      UPDATE(out_Suv, dst);
-      UPDATE(out_Svv, dtt);
-#undef UPDATE
-
-      if (out_N) {
-        assert(out_Su && out_Sv);
-        // Compute the normals xxfixme not normalized?
-        Vector3 Su = out_Su->col(i);
-        Vector3 Sv = out_Sv->col(i);
-        out_N->col(i) = Su.cross(Sv);
+    // Locate the patch corresponding to the face ptex idx and (u,v)
+    int patch = topology->patch_of(face, u, v);
+
+    // Evaluate the patch weights, identify the CVs and compute the limit frame.
+    // Position and first derivative weights come from the cache if it has them for this point.
+    float *pWeights = pBuffer, *dsWeights = dsBuffer, *dtWeights = dtBuffer;
+    if (cache) {
+      pWeights = &cache->weights[size_t(i) * 3 * N];
+      dsWeights = pWeights + N;
+      dtWeights = dsWeights + N;
+      SurfacePoint& key = cache->keys[i];
+      if (key.face == face && key.u == uv[i].u)
+        ++cache->hits;
+      else {
+        evaluate_basis(patch, u, v, pWeights, dsWeights, dtWeights, 0, 0, 0);
+        key = uv[i];
+        ++cache->misses;
       }
+    }
+    else if (Mask & EVAL_SECOND)
+      evaluate_basis(patch, u, v, pWeights, dsWeights, dtWeights,
+        out.Suu ? dssWeights : 0, out.Suv ? dstWeights : 0, out.Svv ? dttWeights : 0);
+    else
+      evaluate_basis(patch, u, v, pWeights, dsWeights, dtWeights, 0, 0, 0);
+
+    Far::Index const* cvs = topology->patch_cvs(patch);
+    int ncvs = (N == SubdivTopology::regular_patch_size) ? N : topology->patch_size(patch);
+    // A regular patch among Gregory ones has only 16 weights: the products below read N, and
+    // zero padding CVs times uninitialized weights can still be NaN
+    for (int cv = ncvs; cv < N; ++cv) {
+      pWeights[cv] = dsWeights[cv] = dtWeights[cv] = 0;
+      if (Mask & EVAL_SECOND)
+        dssWeights[cv] = dstWeights[cv] = dttWeights[cv] = 0;
+    }
+    if (patch != gathered_patch) {
+      for (int cv = 0; cv < ncvs; ++cv)
+        cv_points.col(cv) = evaluation_verts_buffer[cvs[cv]].point;
+      for (int cv = ncvs; cv < N; ++cv)
+        cv_points.col(cv).setZero();
+      gathered_patch = patch;
+    }
+
+    out.S->col(i) = cv_points * Weights(pWeights).template cast<Scalar>();
+    if (Mask & EVAL_FIRST) {
+      out.Su->col(i) = cv_points * Weights(dsWeights).template cast<Scalar>();
+      out.Sv->col(i) = cv_points * Weights(dtWeights).template cast<Scalar>();
+    }
+    if (Mask & EVAL_SECOND) {
+      if (out.Suu) out.Suu->col(i) = cv_points * Weights(dssWeights).template cast<Scalar>();
+      if (out.Suv) out.Suv->col(i) = cv_points * Weights(dstWeights).template cast<Scalar>();
+      if (out.Svv) out.Svv->col(i) = cv_points * Weights(dttWeights).template cast<Scalar>();
+    }
+    if (Mask & EVAL_NORMALS) {
+      // Compute the normals xxfixme not normalized?
+      Vector3 Su = out.Su->col(i);
+      Vector3 Sv = out.Sv->col(i);
+      out.N->col(i) = Su.cross(Sv);
+    }
+    if (Mask & EVAL_DSDX)
+      add_dSdX(i, cvs, ncvs, pWeights, dsWeights, dtWeights, out);
+  }
+}
 
-      assert(!out_Nu && !out_Nv); // unimplemented
+void SubdivEvaluator::initSurfaceCache(Matrix3X const& vert_coords, std::vector<SurfacePoint> const& uv, SurfaceCache* cache) const
+{
+  cache->uv = uv;
+  cache->X = vert_coords;
+  cache->S.resize(3, uv.size());
+  cache->Su.resize(3, uv.size());
+  cache->Sv.resize(3, uv.size());
+  cache->basis.keys.clear();
+  evaluateSubdivSurface(vert_coords, uv, &cache->S, 0, 0, 0, &cache->Su, &cache->Sv, 0, 0, 0, 0, 0, 0, &cache->basis);
+  cache->num_updated = uv.size();
+
+  // Points by patch, by counting sort
+  int nPatches = int(topology->patch_vertices.size() / topology->patch_stride);
+  std::vector<int> point_patch(uv.size());
+  cache->patch_point_offsets.assign(nPatches + 1, 0);
+  for (size_t i = 0; i < uv.size(); ++i) {
+    point_patch[i] = topology->patch_of(uv[i].face, uv[i].u[0], uv[i].u[1]);
+    ++cache->patch_point_offsets[point_patch[i] + 1];
+  }
+  for (int patch = 0; patch < nPatches; ++patch)
+    cache->patch_point_offsets[patch + 1] += cache->patch_point_offsets[patch];
+  cache->patch_points.resize(uv.size());
+  std::vector<int> next(cache->patch_point_offsets.begin(), cache->patch_point_offsets.end() - 1);
+  for (size_t i = 0; i < uv.size(); ++i)
+    cache->patch_points[next[point_patch[i]]++] = int(i);
+
+  cache->delta.assign(evaluation_verts_buffer.size(), Vector3::Zero());
+  cache->patch_dirty.assign(nPatches, 0);
+}
 
-                                  // Compute derivatives wrt control vertices
-      int n_to_compute = (out_dSdX ? 1 : 0) + (out_dSudX ? 1 : 0) + (out_dSvdX ? 1 : 0);
+size_t SubdivEvaluator::updateSurfaceCache(Matrix3X const& vert_coords, SurfaceCache* cache) const
+{
+  assert(vert_coords.cols() == cache->X.cols());
+  size_t nVertices = topology->nVertices;
+  SubdivTopology::Influence const& influence = topology->influence();
+  int const* st_offsets = topology->stencil_offsets.data();
+  Far::Index const* st_indices = topology->stencil_indices.data();
+  float const* st_weights = topology->stencil_weights.data();
+  std::vector<Vector3>& delta = cache->delta;
+  std::vector<int>& dirty_points = cache->dirty_points;
+
+  // The dirty cage vertices
+  dirty_points.clear();
+  for (size_t v = 0; v < nVertices; ++v)
+    if (vert_coords.col(v) != cache->X.col(v)) {
+      delta[v] = vert_coords.col(v) - cache->X.col(v);
+      dirty_points.push_back(int(v));
+    }
+  size_t num_dirty_vertices = dirty_points.size();
+  if (num_dirty_vertices == 0)
+    return cache->num_updated = 0;
+  if (num_dirty_vertices > nVertices / 4) {
+    for (int v : dirty_points)
+      delta[v].setZero();
+    std::vector<SurfacePoint> uv;
+    uv.swap(cache->uv);
+    initSurfaceCache(vert_coords, uv, cache);
+    return cache->num_updated;
+  }
 
-      if (n_to_compute == 0)
+  // The stencil points they move, each summed once over its whole stencil
+  for (size_t d = 0; d < num_dirty_vertices; ++d) {
+    int v = dirty_points[d];
+    for (int k = influence.vertex_stencil_offsets[v]; k < influence.vertex_stencil_offsets[v + 1]; ++k) {
+      int point = int(nVertices) + influence.vertex_stencils[k];
+      if (delta[point] != Vector3::Zero())
+        continue;
+      int s = influence.vertex_stencils[k];
+      Vector3 p = Vector3::Zero();
+      for (int j = st_offsets[s]; j < st_offsets[s + 1]; ++j)
+        p += st_weights[j] * delta[st_indices[j]];
+      if (p == Vector3::Zero())
         continue;
+      delta[point] = p;
+      dirty_points.push_back(point);
+    }
+  }
 
-      //Compute the weights for the coordinates and the derivatives wrt the control vertices
-      //Set all weights to zero
-      MatrixXX accumulated_weights(n_to_compute, nVertices);
-      accumulated_weights.setZero();
-      std::vector<bool> has_nonzero_weight(nVertices, false);
-
-      for (int cv = 0; cv < cvs.size(); ++cv)
-      {
-        if (cvs[cv] < nVertices)
-        {
-          int c = 0;
-          if (out_dSdX)  accumulated_weights(c++, cvs[cv]) += pWeights[cv];
-          if (out_dSudX) accumulated_weights(c++, cvs[cv]) += dsWeights[cv];
-          if (out_dSvdX) accumulated_weights(c++, cvs[cv]) += dtWeights[cv];
-          has_nonzero_weight[cv] = true;
-        }
-        else
-        {
-          size_t ind_offset = cvs[cv] - nVertices;
-          //Look at the stencil associated to this local point and distribute its weight over the control vertices
-          unsigned int size_st = st[ind_offset].GetSize();
-          Far::Index const *st_ind = st[ind_offset].GetVertexIndices();
-          float const *st_weights = st[ind_offset].GetWeights();
-          for (unsigned int s = 0; s < size_st; s++)
-          {
-            int c = 0;
-            if (out_dSdX)  accumulated_weights(c++, st_ind[s]) += pWeights[cv] * st_weights[s];
-            if (out_dSudX) accumulated_weights(c++, st_ind[s]) += dsWeights[cv] * st_weights[s];
-            if (out_dSvdX) accumulated_weights(c++, st_ind[s]) += dtWeights[cv] * st_weights[s];
-            has_nonzero_weight[st_ind[s]] = true;
-          }
-        }
+  // The patches with a dirty CV
+  cache->dirty_patches.clear();
+  for (int point : dirty_points)
+    for (int k = influence.point_patch_offsets[point]; k < influence.point_patch_offsets[point + 1]; ++k) {
+      int patch = influence.point_patches[k];
+      if (!cache->patch_dirty[patch]) {
+        cache->patch_dirty[patch] = 1;
+        cache->dirty_patches.push_back(patch);
       }
+    }
+
+  // Add the change at their points
+  int stride = topology->patch_stride;
+  size_t num_updated = 0;
+  for (int patch : cache->dirty_patches) {
+    Far::Index const* cvs = topology->patch_cvs(patch);
+    int ncvs = topology->patch_size(patch);
+    for (int k = cache->patch_point_offsets[patch]; k < cache->patch_point_offsets[patch + 1]; ++k) {
+      int i = cache->patch_points[k];
+      float const* pWeights = &cache->basis.weights[size_t(i) * 3 * stride];
+      float const* dsWeights = pWeights + stride;
+      float const* dtWeights = dsWeights + stride;
+      Vector3 dS = Vector3::Zero(), dSu = Vector3::Zero(), dSv = Vector3::Zero();
+      for (int cv = 0; cv < ncvs; ++cv) {
+        Vector3 const& d = delta[cvs[cv]];
+        dS += pWeights[cv] * d;
+        dSu += dsWeights[cv] * d;
+        dSv += dtWeights[cv] * d;
+      }
+      cache->S.col(i) += dS;
+      cache->Su.col(i) += dSu;
+      cache->Sv.col(i) += dSv;
+    }
+    num_updated += cache->patch_point_offsets[patch + 1] - cache->patch_point_offsets[patch];
+    cache->patch_dirty[patch] = 0;
+  }
+
+  for (int point : dirty_points) {
+    if (size_t(point) < nVertices)
+      cache->X.col(point) = vert_coords.col(point);
+    delta[point].setZero();
+  }
+  return cache->num_updated = num_updated;
+}
 
-      //Store the weights
-      float scale = 1.f / cvs.size(); // xxawf fixme -- what is the correct value?
-      for (int cv = 0; cv < nVertices; cv++)
-        if (has_nonzero_weight[cv])
-        {
-          int c = 0;
-          if (out_dSdX)   out_dSdX->add(i, cv, accumulated_weights(c++, cv)*scale);
-          if (out_dSudX) out_dSudX->add(i, cv, accumulated_weights(c++, cv)*scale);
-          if (out_dSvdX) out_dSvdX->add(i, cv, accumulated_weights(c++, cv)*scale);
-        }
+void SubdivEvaluator::add_dSdX(int i, Far::Index const* cvs, int ncvs, float const* pWeights, float const* dsWeights, float const* dtWeights, Outputs const& out) const
+{
+  size_t nVertices = topology->nVertices;
+  int const* st_offsets = topology->stencil_offsets.data();
+
+  // Distribute the CV weights over the cage vertices: a CV is either one itself, or a refined
+  // vertex or local point whose stencil spreads it over several.
+  auto accumulate = [&](Far::Index vertex, float weight, int cv) {
+    if (!dX_touched[vertex]) {
+      dX_touched[vertex] = 1;
+      dX_vertices.push_back(vertex);
+    }
+    dX_weights(0, vertex) += pWeights[cv] * weight;
+    dX_weights(1, vertex) += dsWeights[cv] * weight;
+    dX_weights(2, vertex) += dtWeights[cv] * weight;
+  };
+  for (int cv = 0; cv < ncvs; ++cv) {
+    if (size_t(cvs[cv]) < nVertices)
+      accumulate(cvs[cv], 1, cv);
+    else {
+      //Look at the stencil associated to this local point and distribute its weight over the control vertices
+      size_t ind_offset = cvs[cv] - nVertices;
+      for (int s = st_offsets[ind_offset]; s < st_offsets[ind_offset + 1]; ++s)
+        accumulate(topology->stencil_indices[s], topology->stencil_weights[s], cv);
     }
   }
+
+  //Store the weights, and clear them for the next point
+  for (Far::Index vertex : dX_vertices) {
+    if (out.dSdX)  out.dSdX->add(i, vertex, dX_weights(0, vertex));
+    if (out.dSudX) out.dSudX->add(i, vertex, dX_weights(1, vertex));
+    if (out.dSvdX) out.dSvdX->add(i, vertex, dX_weights(2, vertex));
+    dX_weights.col(vertex).setZero();
+    dX_touched[vertex] = 0;
+  }
+  dX_vertices.clear();
 }
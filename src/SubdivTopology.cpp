@@ -0,0 +1,467 @@
+#include "SubdivTopology.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+// A Catmull-Clark refiner for the mesh, not yet refined
+static Far::TopologyRefiner* create_refiner(MeshTopology const& mesh)
+{
+  size_t  num_faces = mesh.num_faces();
+
+  //Fill the topology of the mesh
+  Far::TopologyDescriptor desc;
+  desc.numVertices = (int) mesh.num_vertices;
+  desc.numFaces = (int) num_faces;
+
+  Eigen::VectorXi vertsperface((int) num_faces);
+  vertsperface.setConstant((int) mesh.quads.rows());
+
+  desc.numVertsPerFace = vertsperface.data();
+  desc.vertIndicesPerFace = mesh.quads.data();
+
+  //Instantiate a FarTopologyRefiner from the descriptor.
+  Sdc::SchemeType type = OpenSubdiv::Sdc::SCHEME_CATMARK;
+  // Adpative refinement is only supported for CATMARK
+  // Scheme LOOP is only supported if the mesh is purely composed of triangles
+
+  Sdc::Options options;
+  options.SetVtxBoundaryInterpolation(Sdc::Options::VTX_BOUNDARY_NONE);
+  typedef Far::TopologyRefinerFactory<Far::TopologyDescriptor> Refinery;
+  return Refinery::Create(desc, Refinery::Options(type, options));
+}
+
+SubdivTopology::SubdivTopology(MeshTopology const& mesh_in, Options const& options) :
+  mesh(mesh_in),
+  options(options),
+  hash(compute_hash(mesh_in, options))
+{
+  if (mesh.face_adj.cols() != mesh.quads.cols())
+    mesh.update_adjacencies();
+
+  nVertices = mesh.num_vertices;
+
+  std::unique_ptr<Far::TopologyRefiner> refiner(create_refiner(mesh));
+
+  refiner->RefineAdaptive(Far::TopologyRefiner::AdaptiveOptions(options.isolation));
+
+  // Generate a set of Far::PatchTable that we will use to evaluate the surface limit
+  Far::PatchTableFactory::Options patchOptions;
+  switch (options.end_cap) {
+  case ENDCAP_BSPLINE:
+    patchOptions.endCapType = Far::PatchTableFactory::Options::ENDCAP_BSPLINE_BASIS;
+    break;
+  case ENDCAP_LEGACY_GREGORY:
+    // Legacy Gregory patches need the vertex valence and quad offset tables, which only the
+    // GPU evaluators use: Far::PatchTable::EvaluateBasis doesn't handle them.
+    std::cerr << "SubdivTopology: legacy Gregory patches can't be evaluated here, using Gregory basis end caps\n";
+    // Fall through
+  case ENDCAP_GREGORY:
+    patchOptions.endCapType = Far::PatchTableFactory::Options::ENDCAP_GREGORY_BASIS;
+    break;
+  }
+
+  patchTable.reset(Far::PatchTableFactory::Create(*refiner, patchOptions));
+
+  // Compute the total number of points we need to evaluate patchtable.
+  // we use local points around extraordinary features.
+  nRefinerVertices = refiner->GetNumVerticesTotal();
+  nLocalPoints = patchTable->GetNumLocalPoints();
+
+  // Create a Far::PatchMap to help locating patches in the table
+  patchMap.reset(new Far::PatchMap(*patchTable));
+
+  // At isolation level 0 the refiner has only the cage vertices, and the local point stencils
+  // are already in terms of them.  Otherwise the vertices of the isolation levels and the local
+  // points (which are in terms of those) get stencils factorized down to the cage.
+  Far::StencilTable const* localStencils = patchTable->GetLocalPointStencilTable();
+  std::unique_ptr<Far::StencilTable const> refinedStencils, allStencils;
+  if (nRefinerVertices > nVertices) {
+    Far::StencilTableFactory::Options stencilOptions;
+    stencilOptions.generateOffsets = true;
+    stencilOptions.generateControlVerts = false;
+    stencilOptions.generateIntermediateLevels = true;
+    stencilOptions.factorizeIntermediateLevels = true;
+    stencilOptions.maxLevel = options.isolation;
+    refinedStencils.reset(Far::StencilTableFactory::Create(*refiner, stencilOptions));
+    if (localStencils)
+      allStencils.reset(Far::StencilTableFactory::AppendLocalPointStencilTable(*refiner, refinedStencils.get(), localStencils));
+  }
+  flatten(allStencils ? allStencils.get() : refinedStencils ? refinedStencils.get() : localStencils);
+  assert(stencil_offsets.size() == nRefinerVertices - nVertices + nLocalPoints + 1);
+}
+
+// Copy what the evaluator needs out of patchTable, patchMap and the stencils
+void SubdivTopology::flatten(Far::StencilTable const* stencils)
+{
+  int num_faces = int(mesh.num_faces());
+  int num_patches = patchTable->GetNumPatchesTotal();
+
+  bool any_gregory = false;
+  for (int array = 0; array < patchTable->GetNumPatchArrays(); ++array)
+    if (patchTable->GetPatchArrayDescriptor(array).GetType() == Far::PatchDescriptor::GREGORY_BASIS)
+      any_gregory = true;
+  patch_stride = any_gregory ? max_patch_size : regular_patch_size;
+
+  patch_vertices.assign(size_t(num_patches) * patch_stride, 0);
+  patch_params.resize(num_patches);
+  gregory_handles.clear();
+  if (any_gregory) {
+    Far::PatchTable::PatchHandle none = { -1, -1, -1 };
+    gregory_handles.assign(num_patches, none);
+  }
+  face_patch.assign(num_faces, -1);
+  std::vector<int> patches_per_face(num_faces, 0);
+  Far::Index vert_index = 0;   // Of the patch's first CV in patchTable, for its handle
+  for (int array = 0, patch = 0; array < patchTable->GetNumPatchArrays(); ++array) {
+    Far::PatchDescriptor::Type type = patchTable->GetPatchArrayDescriptor(array).GetType();
+    assert(type == Far::PatchDescriptor::REGULAR || type == Far::PatchDescriptor::GREGORY_BASIS);
+    for (int p = 0; p < patchTable->GetNumPatches(array); ++p, ++patch) {
+      Far::ConstIndexArray cvs = patchTable->GetPatchVertices(array, p);
+      assert(cvs.size() == (type == Far::PatchDescriptor::REGULAR ? regular_patch_size : max_patch_size));
+      for (int cv = 0; cv < cvs.size(); ++cv)
+        patch_vertices[size_t(patch) * patch_stride + cv] = cvs[cv];
+
+      if (type == Far::PatchDescriptor::GREGORY_BASIS) {
+        Far::PatchTable::PatchHandle handle = { array, patch, vert_index };
+        gregory_handles[patch] = handle;
+      }
+      vert_index += cvs.size();
+
+      Far::PatchParam param = patchTable->GetPatchParam(array, p);
+      patch_params[patch] = param;
+      // Faces are quads, so ptex faces are faces
+      int face = param.GetFaceId();
+      face_patch[face] = patch;
+      ++patches_per_face[face];
+    }
+  }
+
+  // Faces split into several patches by adaptive isolation are left to patchMap
+  num_isolated_faces = 0;
+  for (int face = 0; face < num_faces; ++face)
+    if (patches_per_face[face] != 1) {
+      face_patch[face] = -1;
+      ++num_isolated_faces;
+    }
+
+  int nstencils = stencils ? stencils->GetNumStencils() : 0;
+  stencil_offsets.assign(1, 0);
+  stencil_indices.clear();
+  stencil_weights.clear();
+  for (int i = 0; i < nstencils; i++) {
+    Far::Stencil stencil = stencils->GetStencil(Far::Index(i));
+    stencil_indices.insert(stencil_indices.end(), stencil.GetVertexIndices(), stencil.GetVertexIndices() + stencil.GetSize());
+    stencil_weights.insert(stencil_weights.end(), stencil.GetWeights(), stencil.GetWeights() + stencil.GetSize());
+    stencil_offsets.push_back(int(stencil_indices.size()));
+  }
+}
+
+Far::TopologyRefiner const& SubdivTopology::uniform_refiner() const
+{
+  std::call_once(refiner2_once, [this]() {
+    // Uniformly refine the topolgy up to 'maxlevel'
+    Far::TopologyRefiner* refiner = create_refiner(mesh);
+    refiner->RefineUniform(Far::TopologyRefiner::UniformOptions(maxlevel));
+    refiner2.reset(refiner);
+  });
+  return *refiner2;
+}
+
+Osd::CpuPatchTable const* SubdivTopology::osd_patch_table() const
+{
+  std::call_once(osd_patch_table_once, [this]() {
+    if (patchTable)
+      osd_patches.reset(Osd::CpuPatchTable::Create(patchTable.get()));
+  });
+  return osd_patches.get();
+}
+
+SubdivTopology::Influence const& SubdivTopology::influence() const
+{
+  std::call_once(influence_once, [this]() {
+    Influence* t = new Influence;
+    // Counting inversions of the CSR stencils and of the patch CVs
+    auto invert = [](size_t n, std::vector<std::pair<int, int> > const& pairs, std::vector<int>* offsets, std::vector<int>* values) {
+      offsets->assign(n + 1, 0);
+      for (auto const& p : pairs)
+        ++(*offsets)[p.first + 1];
+      for (size_t i = 0; i < n; ++i)
+        (*offsets)[i + 1] += (*offsets)[i];
+      values->resize(pairs.size());
+      std::vector<int> next(offsets->begin(), offsets->end() - 1);
+      for (auto const& p : pairs)
+        (*values)[next[p.first]++] = p.second;
+    };
+
+    std::vector<std::pair<int, int> > pairs;
+    size_t nStencils = stencil_offsets.empty() ? 0 : stencil_offsets.size() - 1;
+    for (size_t s = 0; s < nStencils; ++s)
+      for (int k = stencil_offsets[s]; k < stencil_offsets[s + 1]; ++k)
+        pairs.push_back(std::make_pair(int(stencil_indices[k]), int(s)));
+    invert(nVertices, pairs, &t->vertex_stencil_offsets, &t->vertex_stencils);
+
+    // A patch can list a point more than once, e.g. on boundaries
+    pairs.clear();
+    int nPatches = int(patch_vertices.size() / patch_stride);
+    for (int patch = 0; patch < nPatches; ++patch) {
+      Far::Index const* cvs = patch_cvs(patch);
+      for (int cv = 0; cv < patch_size(patch); ++cv)
+        pairs.push_back(std::make_pair(int(cvs[cv]), patch));
+    }
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+    invert(nVertices + nStencils, pairs, &t->point_patch_offsets, &t->point_patches);
+
+    influence_tables.reset(t);
+  });
+  return *influence_tables;
+}
+
+// FNV-1a over the vertex count, face indices and options
+uint64_t SubdivTopology::compute_hash(MeshTopology const& mesh, Options const& options)
+{
+  uint64_t h = 14695981039346656037ull;
+  auto mix = [&h](uint64_t word) {
+    for (int b = 0; b < 8; ++b) {
+      h ^= (word >> (8 * b)) & 0xff;
+      h *= 1099511628211ull;
+    }
+  };
+  mix(mesh.num_vertices);
+  mix(uint64_t(mesh.quads.cols()));
+  for (Eigen::Index i = 0; i < mesh.quads.size(); ++i)
+    mix(uint64_t(uint32_t(mesh.quads.data()[i])));
+  // Left out for the defaults, so cache files from before there were options stay valid
+  if (!(options == Options())) {
+    mix(uint64_t(options.isolation));
+    mix(uint64_t(options.end_cap));
+  }
+  return h;
+}
+
+static std::mutex cache_lock;
+static std::map<uint64_t, std::shared_ptr<SubdivTopology const> > cache;
+std::string SubdivTopology::cache_directory;
+
+std::shared_ptr<SubdivTopology const> SubdivTopology::get(MeshTopology const& mesh, Options const& options)
+{
+  uint64_t hash = compute_hash(mesh, options);
+  {
+    std::lock_guard<std::mutex> guard(cache_lock);
+    auto it = cache.find(hash);
+    if (it != cache.end() && it->second->options == options && it->second->mesh.num_vertices == mesh.num_vertices &&
+        it->second->mesh.quads.cols() == mesh.quads.cols() && (it->second->mesh.quads == mesh.quads).all())
+      return it->second;
+  }
+
+  // Load or build outside the lock: it may take a while, and two threads building the same
+  // topology at once just do some redundant work.
+  std::shared_ptr<SubdivTopology const> topology;
+  if (!cache_directory.empty())
+    topology = load(cache_filename(hash), mesh, options);
+  if (!topology) {
+    topology.reset(new SubdivTopology(mesh, options));
+    // Isolated faces and Gregory patches need patchMap and patchTable, which aren't in the file
+    if (!cache_directory.empty() && topology->cacheable() && !topology->save(cache_filename(hash)))
+      std::cerr << "SubdivTopology: could not write " << cache_filename(hash) << "\n";
+  }
+
+  std::lock_guard<std::mutex> guard(cache_lock);
+  cache[hash] = topology;
+  return topology;
+}
+
+void SubdivTopology::clear_cache()
+{
+  std::lock_guard<std::mutex> guard(cache_lock);
+  cache.clear();
+}
+
+std::string SubdivTopology::cache_filename(uint64_t hash)
+{
+  std::ostringstream name;
+  name << cache_directory << "/subdiv-" << std::hex << std::setw(16) << std::setfill('0') << hash << ".osdcache";
+  return name.str();
+}
+
+// Cache file layout: CacheHeader, then the sections in CacheSection order, each starting
+// on an 8-byte boundary.
+namespace {
+  enum CacheSection {
+    QUADS, FACE_ADJ, FACE_PATCH, PATCH_VERTICES, PATCH_PARAMS,
+    STENCIL_OFFSETS, STENCIL_INDICES, STENCIL_WEIGHTS,
+    NUM_SECTIONS
+  };
+
+  struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;   // byte_order_mark as written, to reject files from other-endian machines
+    uint64_t hash;
+    uint64_t num_vertices;
+    uint64_t num_faces;
+    uint64_t num_refiner_vertices;
+    uint64_t num_local_points;
+    uint64_t num_patches;
+    uint64_t num_stencil_entries;
+    uint64_t section_offset[NUM_SECTIONS];
+  };
+
+  char const cache_magic[8] = { 'O', 'S', 'D', 'F', 'I', 'T', 'T', 'C' };
+  uint32_t const byte_order_mark = 0x01020304;
+
+  struct Section {
+    char const* data;
+    uint64_t bytes;
+  };
+
+  template <typename T>
+  Section section(T const* data, size_t count)
+  {
+    Section s = { reinterpret_cast<char const*>(data), uint64_t(count * sizeof(T)) };
+    return s;
+  }
+
+  // The sections of t, whose arrays must already have their final sizes
+  void get_sections(SubdivTopology const& t, Section* sections)
+  {
+    sections[QUADS] = section(t.mesh.quads.data(), t.mesh.quads.size());
+    sections[FACE_ADJ] = section(t.mesh.face_adj.data(), t.mesh.face_adj.size());
+    sections[FACE_PATCH] = section(t.face_patch.data(), t.face_patch.size());
+    sections[PATCH_VERTICES] = section(t.patch_vertices.data(), t.patch_vertices.size());
+    sections[PATCH_PARAMS] = section(t.patch_params.data(), t.patch_params.size());
+    sections[STENCIL_OFFSETS] = section(t.stencil_offsets.data(), t.stencil_offsets.size());
+    sections[STENCIL_INDICES] = section(t.stencil_indices.data(), t.stencil_indices.size());
+    sections[STENCIL_WEIGHTS] = section(t.stencil_weights.data(), t.stencil_weights.size());
+  }
+
+  uint64_t align8(uint64_t offset) { return (offset + 7) & ~uint64_t(7); }
+}
+
+bool SubdivTopology::save(std::string const& filename) const
+{
+  if (!cacheable())
+    return false;
+
+  Section sections[NUM_SECTIONS];
+  get_sections(*this, sections);
+
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, cache_magic, sizeof(cache_magic));
+  header.version = cache_version;
+  header.byte_order = byte_order_mark;
+  header.hash = hash;
+  header.num_vertices = nVertices;
+  header.num_faces = mesh.num_faces();
+  header.num_refiner_vertices = nRefinerVertices;
+  header.num_local_points = nLocalPoints;
+  header.num_patches = patch_params.size();
+  header.num_stencil_entries = stencil_indices.size();
+  uint64_t offset = align8(sizeof(header));
+  for (int s = 0; s < NUM_SECTIONS; ++s) {
+    header.section_offset[s] = offset;
+    offset = align8(offset + sections[s].bytes);
+  }
+
+  // Write to a temporary and rename, so a concurrent load never sees a partial file
+  std::string tmpname = filename + ".tmp";
+  {
+    std::ofstream out(tmpname.c_str(), std::ios::binary);
+    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    char const zeros[8] = {};
+    uint64_t pos = sizeof(header);
+    for (int s = 0; s < NUM_SECTIONS; ++s) {
+      out.write(zeros, header.section_offset[s] - pos);
+      out.write(sections[s].data, sections[s].bytes);
+      pos = header.section_offset[s] + sections[s].bytes;
+    }
+    if (!out) {
+      out.close();
+      std::remove(tmpname.c_str());
+      return false;
+    }
+  }
+  std::remove(filename.c_str());
+  return std::rename(tmpname.c_str(), filename.c_str()) == 0;
+}
+
+std::shared_ptr<SubdivTopology const> SubdivTopology::load(std::string const& filename, MeshTopology const& mesh, Options const& options)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary | std::ios::ate);
+  uint64_t file_size = uint64_t(std::streamoff(in.tellg()));
+  in.seekg(0);
+  CacheHeader header;
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 ||
+      header.version != cache_version ||
+      header.byte_order != byte_order_mark ||
+      header.hash != compute_hash(mesh, options) ||
+      header.num_vertices != mesh.num_vertices ||
+      header.num_faces != mesh.num_faces())
+    return nullptr;
+
+  // The sizes, before allocating for them: each array must fit in the file
+  if (header.num_refiner_vertices < header.num_vertices ||
+      header.num_local_points > file_size / sizeof(int) ||
+      header.num_refiner_vertices - header.num_vertices > file_size / sizeof(int) ||
+      header.num_patches > file_size / (regular_patch_size * sizeof(Far::Index)) ||
+      header.num_stencil_entries > file_size / (sizeof(Far::Index) + sizeof(float)))
+    return nullptr;
+
+  std::shared_ptr<SubdivTopology> t(new SubdivTopology);
+  t->options = options;
+  t->hash = header.hash;
+  t->nVertices = header.num_vertices;
+  t->nRefinerVertices = header.num_refiner_vertices;
+  t->nLocalPoints = header.num_local_points;
+  t->num_isolated_faces = 0;
+  t->mesh.num_vertices = header.num_vertices;
+  t->mesh.quads.resize(4, header.num_faces);
+  t->mesh.face_adj.resize(4, header.num_faces);
+  t->face_patch.resize(header.num_faces);
+  t->patch_vertices.resize(header.num_patches * regular_patch_size);
+  t->patch_params.resize(header.num_patches);
+  t->stencil_offsets.resize(header.num_refiner_vertices - header.num_vertices + header.num_local_points + 1);
+  t->stencil_indices.resize(header.num_stencil_entries);
+  t->stencil_weights.resize(header.num_stencil_entries);
+
+  // Read straight into the arrays just sized
+  Section sections[NUM_SECTIONS];
+  get_sections(*t, sections);
+  for (int s = 0; s < NUM_SECTIONS; ++s)
+    if (!in.seekg(header.section_offset[s]) || !in.read(const_cast<char*>(sections[s].data), sections[s].bytes))
+      return nullptr;
+
+  // A hash collision, or a damaged file: check every index, as the evaluator doesn't
+  if ((t->mesh.quads != mesh.quads).any() || t->stencil_offsets.front() != 0 ||
+      t->stencil_offsets.back() != int(header.num_stencil_entries))
+    return nullptr;
+  for (size_t k = 1; k < t->stencil_offsets.size(); ++k)
+    if (t->stencil_offsets[k] < t->stencil_offsets[k - 1])
+      return nullptr;
+  for (Far::Index index : t->stencil_indices)
+    if (index < 0 || size_t(index) >= t->nVertices)
+      return nullptr;
+  // Cage vertices, then a point per stencil
+  size_t num_points = t->nVertices + t->stencil_offsets.size() - 1;
+  for (Far::Index cv : t->patch_vertices)
+    if (cv < 0 || size_t(cv) >= num_points)
+      return nullptr;
+  for (int patch : t->face_patch)
+    if (patch < 0 || patch >= int(header.num_patches))
+      return nullptr;
+  int num_faces = int(header.num_faces);
+  for (Eigen::Index k = 0; k < t->mesh.face_adj.size(); ++k)
+    if (t->mesh.face_adj(k) < -1 || t->mesh.face_adj(k) >= num_faces)
+      return nullptr;
+
+  return t;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <iso646.h> //To define the words and, not, etc. as operators in Windows
+#include <opensubdiv/far/topologyDescriptor.h>
+#include <opensubdiv/far/patchTableFactory.h>
+#include <opensubdiv/far/patchMap.h>
+#include <opensubdiv/far/stencilTable.h>
+#include <opensubdiv/osd/cpuPatchTable.h>
+
+#include "MeshTopology.h"
+
+using namespace OpenSubdiv;
+
+// Everything the evaluator derives from a cage's topology: the mesh and its face adjacency,
+// the patches and local point stencils for limit evaluation, and a uniform refiner for
+// generate_refined_mesh.  Built once and never modified, so it is shared (between evaluators,
+// functors and threads) through SubdivTopology::get.
+//
+// The patch data is kept in flat arrays, which are all the evaluator reads, so that they can be
+// saved to and loaded from a cache file (see save/load) instead of being recomputed at startup.
+struct SubdivTopology {
+  // How the limit surface around extraordinary vertices is represented
+  enum EndCap {
+    ENDCAP_BSPLINE,          // Regular patches fitted to the limit: cheap, but approximate
+    ENDCAP_GREGORY,          // Gregory basis patches of 20 CVs, closer to the limit
+    ENDCAP_LEGACY_GREGORY    // Not evaluable on the CPU, so built as ENDCAP_GREGORY
+  };
+  struct Options {
+    int isolation;           // Adaptive refinement level around extraordinary vertices
+    EndCap end_cap;          // Patches at extraordinary vertices after isolation
+    Options() : isolation(0), end_cap(ENDCAP_BSPLINE) {}
+    bool operator==(Options const& that) const { return isolation == that.isolation && end_cap == that.end_cap; }
+  };
+
+  MeshTopology mesh;
+  Options options;
+  uint64_t hash;            // Of the mesh and options
+
+  size_t  nVertices;
+  size_t  nRefinerVertices;
+  size_t  nLocalPoints;
+
+  // Patches: regular B-spline patches, evaluated from patch_params, and with ENDCAP_GREGORY,
+  // Gregory basis patches, evaluated through patchTable.
+  static const int regular_patch_size = 16;
+  static const int max_patch_size = 20;
+  int patch_stride;                            // CVs stored per patch
+  std::vector<Far::Index> patch_vertices;      // Into [cage vertices, stencil points]
+  std::vector<Far::PatchParam> patch_params;
+  std::vector<Far::PatchTable::PatchHandle> gregory_handles;   // Per patch, for Gregory patches only, else empty
+  bool is_gregory(int patch) const { return !gregory_handles.empty() && gregory_handles[patch].arrayIndex >= 0; }
+  int patch_size(int patch) const { return is_gregory(patch) ? max_patch_size : regular_patch_size; }
+  Far::Index const* patch_cvs(int patch) const { return &patch_vertices[size_t(patch) * patch_stride]; }
+
+  // Patch map: face -> patch for faces covered by a single patch, which at isolation level 0 is
+  // all of them, and -1 for faces adaptive isolation split into several, found through patchMap.
+  std::vector<int> face_patch;
+  int num_isolated_faces;
+  int patch_of(int face, Scalar u, Scalar v) const
+  {
+    int patch = face_patch[face];
+    if (patch >= 0)
+      return patch;
+    Far::PatchTable::PatchHandle const* handle = patchMap->FindPatch(face, u, v);
+    assert(handle);
+    return handle->patchIndex;
+  }
+
+  // Stencils, in CSR form, of the points patches use beyond the cage vertices: vertices of the
+  // isolation levels, then local points.  Point nVertices + i is the sum over k in
+  // [stencil_offsets[i], stencil_offsets[i+1]) of stencil_weights[k] * cage vertex[stencil_indices[k]]
+  std::vector<int> stencil_offsets;
+  std::vector<Far::Index> stencil_indices;
+  std::vector<float> stencil_weights;
+
+  // The inverse of the tables above, for incremental evaluation (see
+  // SubdivEvaluator::updateSurfaceCache): the stencils that use cage vertex v are
+  // vertex_stencils[vertex_stencil_offsets[v] .. vertex_stencil_offsets[v+1]), and the patches
+  // with point p, a cage vertex or nVertices + a stencil, among their CVs are
+  // point_patches[point_patch_offsets[p] .. point_patch_offsets[p+1]).  Built on first use.
+  struct Influence {
+    std::vector<int> vertex_stencil_offsets;
+    std::vector<int> vertex_stencils;
+    std::vector<int> point_patch_offsets;
+    std::vector<int> point_patches;
+  };
+  Influence const& influence() const;
+
+  // The OSD tables the arrays above were flattened from.  Null when loaded from a cache file,
+  // which is only written for topologies with neither isolated faces nor Gregory patches.
+  std::unique_ptr<Far::PatchTable const> patchTable;
+  std::unique_ptr<Far::PatchMap const> patchMap;
+
+  // patchTable in the form the Osd evaluators take, for SubdivEvaluator's Osd backends.  Built on
+  // first use; null when there is no patchTable.
+  Osd::CpuPatchTable const* osd_patch_table() const;
+
+  // Uniformly refined to maxlevel, built on first use as only generate_refined_mesh needs it
+  static const int maxlevel = 3;
+  Far::TopologyRefiner const& uniform_refiner() const;
+
+  explicit SubdivTopology(MeshTopology const& mesh, Options const& options = Options());
+
+  // The shared topology for this mesh, built on first use and cached by hash thereafter.
+  // Thread-safe.  Cached topologies live until clear_cache().
+  // If cache_directory is set, topologies are also looked for there (see cache_filename), and
+  // saved there when built.  It is empty, so nothing is written, unless set.
+  static std::shared_ptr<SubdivTopology const> get(MeshTopology const& mesh, Options const& options = Options());
+  static void clear_cache();
+  static std::string cache_directory;
+
+  static uint64_t compute_hash(MeshTopology const& mesh, Options const& options = Options());
+
+  // Cache file.  Native byte order, 8-byte aligned sections at offsets given in the header, so
+  // it can be memory-mapped as well as read.  load returns null if the file is missing, has
+  // another version or doesn't match mesh and options.
+  static const uint32_t cache_version = 1;
+  static std::string cache_filename(uint64_t hash);
+  bool cacheable() const { return num_isolated_faces == 0 && gregory_handles.empty(); }
+  bool save(std::string const& filename) const;
+  static std::shared_ptr<SubdivTopology const> load(std::string const& filename, MeshTopology const& mesh, Options const& options = Options());
+
+private:
+  SubdivTopology() : patch_stride(regular_patch_size), num_isolated_faces(0) {}
+  void flatten(Far::StencilTable const* stencils);
+
+  mutable std::once_flag refiner2_once;
+  mutable std::unique_ptr<Far::TopologyRefiner const> refiner2;
+  mutable std::once_flag osd_patch_table_once;
+  mutable std::unique_ptr<Osd::CpuPatchTable const> osd_patches;
+  mutable std::once_flag influence_once;
+  mutable std::unique_ptr<Influence const> influence_tables;
+
+  SubdivTopology(SubdivTopology const&);
+  SubdivTopology& operator=(SubdivTopology const&);
+};
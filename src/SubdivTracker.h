@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+
+#include "Subdiv3D_Functor.h"
+
+// Track one cage through a sequence of point clouds, e.g. consecutive frames of a capture.
+// Point i of every frame is assumed to be the same physical point, so frame t+1 starts from frame t's
+// control vertices and (face,u,v) correspondences.  The functor (and so its evaluator, workspaces and
+// Jacobian triplet storage) and the LM solver stay alive between frames, and only points whose residual
+// at the seeded correspondence exceeds reinit_threshold go through the brute-force search again.
+struct SubdivTracker {
+  typedef Subdiv3D_Functor Functor;
+
+  SubdivTracker(MeshTopology const& mesh, Matrix3X const& control_vertices, Index nDataPoints) :
+    functor(Matrix3X::Zero(3, nDataPoints), mesh),
+    lm(functor),
+    nframes(0),
+    reinit_threshold(0.1f),
+    search_grid(2),
+    first_frame_maxfev(40),
+    maxfev(5),
+    num_reinitialized(0)
+  {
+    params.control_vertices = control_vertices;
+    params.us.resize(nDataPoints);
+  }
+
+  // Fit to the next frame, which must have the same number of points as the first.
+  Eigen::LevenbergMarquardtSpace::Status track(Matrix3X const& data_points)
+  {
+    assert(data_points.cols() == functor.data_points.cols());
+    functor.data_points = data_points;
+    functor.reset_active_set();
+
+    std::vector<int> reinit;
+    if (nframes == 0) {
+      reinit.resize(data_points.cols());
+      for (int i = 0; i < data_points.cols(); ++i)
+        reinit[i] = i;
+    }
+    else {
+      // Residuals of the new points at the previous frame's surface and correspondences
+      residuals.resize(functor.values());
+      functor(params, residuals);
+      Scalar threshold2 = reinit_threshold * reinit_threshold;
+      for (int i = 0; i < data_points.cols(); ++i)
+        if (residuals.segment<3>(3 * i).squaredNorm() > threshold2)
+          reinit.push_back(i);
+    }
+    num_reinitialized = int(reinit.size());
+    if (num_reinitialized > 0)
+      init_correspondences(functor.evaluator, params.control_vertices, data_points, &params.us, &reinit, search_grid);
+
+    lm.setMaxfev(nframes == 0 ? first_frame_maxfev : maxfev);
+    ++nframes;
+    return lm.minimize(params);
+  }
+
+  Functor::InputType const& current() const { return params; }
+  Scalar fnorm() { return lm.fnorm(); }
+
+  Functor functor;
+  Eigen::LevenbergMarquardt<Functor> lm;
+  Functor::InputType params;
+  Functor::ValueType residuals;
+  int nframes;
+
+  // Options
+  Scalar reinit_threshold;   // Residual above which a point's correspondence is searched for again
+  int search_grid;           // Test points per face side for that search
+  int first_frame_maxfev;    // Iterations for the first frame, which starts from scratch
+  int maxfev;                // And for subsequent ones
+
+  // Stats of the last frame
+  int num_reinitialized;
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "Subdiv3D_Functor.h"
+
+// Fit to a growing subset of the data points.  While the cage is far from converged, a small
+// sample constrains it about as well as the full set, so the early LM stages see only a random
+// sample stratified by face, which grows by 'growth' per stage until it is the whole set.  A stage
+// ends once LM converges on its subset, or its steps stop reducing the error much.
+// Points outside the subset are left alone: just before a point joins, its correspondence is
+// checked against a grid search on the current cage, and kept unless that finds a closer point.
+struct SubsetFitter {
+  typedef Subdiv3D_Functor Functor;
+
+  SubsetFitter(SubdivEvaluator const& evaluator) :
+    evaluator(evaluator),
+    initial_size(1000),
+    growth(4),
+    stage_maxfev(5),
+    stage_reduction(Scalar(0.05)),
+    final_maxfev(20),
+    search_grid(1),
+    seed(0),
+    verbose(true),
+    num_stages(0),
+    fnorm(0)
+  {
+  }
+
+  // params->us must hold a correspondence for every point, e.g. from init_correspondences: their
+  // faces are used to stratify the sample, and the first stage starts from them.
+  Eigen::LevenbergMarquardtSpace::Status fit(Matrix3X const& data_points, Functor::InputType* params)
+  {
+    assert(growth > 1);
+    Index n = data_points.cols();
+    std::vector<int> order = stratified_order(params->us);
+
+    Eigen::LevenbergMarquardtSpace::Status status;
+    Index size = std::min(Index(initial_size), n);
+    Index prev = 0;
+    for (num_stages = 0;; ++num_stages) {
+      // Bring the correspondences of the joining points up to date
+      if (prev > 0) {
+        std::vector<int> joining(order.begin() + prev, order.begin() + size);
+        refresh_correspondences(data_points, joining, params);
+      }
+
+      Matrix3X subset(3, size);
+      Functor::InputType subset_params;
+      subset_params.control_vertices = params->control_vertices;
+      subset_params.us.resize(size);
+      for (Index k = 0; k < size; ++k) {
+        subset.col(k) = data_points.col(order[k]);
+        subset_params.us[k] = params->us[order[k]];
+      }
+
+      Functor functor(subset, evaluator);
+      functor.verbose = false;
+      if (point_weights.size() > 0) {
+        functor.point_weights.resize(size);
+        for (Index k = 0; k < size; ++k)
+          functor.point_weights[k] = point_weights[order[k]];
+      }
+      Eigen::LevenbergMarquardt<Functor> lm(functor);
+      if (size == n) {
+        lm.setMaxfev(final_maxfev);
+        status = lm.minimize(subset_params);
+      }
+      else
+        status = minimize_stage(lm, &subset_params);
+      fnorm = lm.fnorm();
+
+      params->control_vertices = subset_params.control_vertices;
+      for (Index k = 0; k < size; ++k)
+        params->us[order[k]] = subset_params.us[k];
+
+      if (verbose)
+        std::cerr << "SubsetFitter: stage " << num_stages << ", " << size << " of " << n
+          << " points, rms err = " << fnorm / std::sqrt(Scalar(size)) << "\n";
+
+      if (size == n)
+        break;
+      prev = size;
+      size = std::min(n, std::max(size + 1, Index(std::ceil(size * growth))));
+    }
+    ++num_stages;
+    return status;
+  }
+
+  // LM on a stage's subset, until it converges, a step reduces the error by less than a fraction
+  // stage_reduction, or stage_maxfev evaluations
+  Eigen::LevenbergMarquardtSpace::Status minimize_stage(Eigen::LevenbergMarquardt<Functor>& lm, Functor::InputType* params) const
+  {
+    using namespace Eigen::LevenbergMarquardtSpace;
+    lm.setMaxfev(stage_maxfev);
+    Status status = lm.minimizeInit(*params);
+    Scalar prev_fnorm = lm.fnorm();
+    while (status == NotStarted || status == Running) {
+      status = lm.minimizeOneStep(*params);
+      if (status == Running && lm.fnorm() > (1 - stage_reduction) * prev_fnorm)
+        break;
+      prev_fnorm = lm.fnorm();
+    }
+    return status;
+  }
+
+  // Each of the points 'joining' keeps its correspondence unless the grid search of
+  // init_correspondences finds a closer point on the current cage
+  void refresh_correspondences(Matrix3X const& data_points, std::vector<int> const& joining, Functor::InputType* params) const
+  {
+    Index n = Index(joining.size());
+    Matrix3X joining_data(3, n);
+    std::vector<SurfacePoint> current(n);
+    for (Index k = 0; k < n; ++k) {
+      joining_data.col(k) = data_points.col(joining[k]);
+      current[k] = params->us[joining[k]];
+    }
+    std::vector<SurfacePoint> searched(n);
+    init_correspondences(evaluator, params->control_vertices, joining_data, &searched, 0, search_grid);
+
+    Matrix3X S_current(3, n);
+    Matrix3X S_searched(3, n);
+    evaluator.evaluateSubdivSurface(params->control_vertices, current, &S_current);
+    evaluator.evaluateSubdivSurface(params->control_vertices, searched, &S_searched);
+    for (Index k = 0; k < n; ++k)
+      if ((S_searched.col(k) - joining_data.col(k)).squaredNorm() < (S_current.col(k) - joining_data.col(k)).squaredNorm())
+        params->us[joining[k]] = searched[k];
+  }
+
+  // A random order of the points any prefix of which takes from each face in proportion to its
+  // number of points: a point's key is (its rank in a shuffle of its face's points + jitter) / that number.
+  std::vector<int> stratified_order(std::vector<SurfacePoint> const& us) const
+  {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<Scalar> jitter(0, 1);
+
+    std::vector<std::vector<int> > by_face(evaluator.topology->mesh.num_faces());
+    for (int i = 0; i < int(us.size()); ++i)
+      by_face[us[i].face].push_back(i);
+
+    std::vector<std::pair<Scalar, int> > keys;
+    keys.reserve(us.size());
+    for (auto& points : by_face) {
+      std::shuffle(points.begin(), points.end(), rng);
+      for (size_t r = 0; r < points.size(); ++r)
+        keys.push_back(std::make_pair((r + jitter(rng)) / points.size(), points[r]));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<int> order(keys.size());
+    for (size_t k = 0; k < keys.size(); ++k)
+      order[k] = keys[k].second;
+    return order;
+  }
+
+  SubdivEvaluator evaluator;
+
+  // Options
+  int initial_size;       // Points in the first stage
+  Scalar growth;          // Factor by which the subset grows per stage
+  int stage_maxfev;       // Evaluations per stage before the last, at most
+  Scalar stage_reduction; // Or until a step reduces the error by less than this fraction
+  int final_maxfev;       // And on the full set
+  int search_grid;        // Test points per face side when refreshing joining points
+  VectorX point_weights;  // Per data point, for each stage's functor (see Subdiv3D_Functor::point_weights), or empty
+  unsigned seed;
+  bool verbose;
+
+  // Stats of the last fit
+  int num_stages;
+  Scalar fnorm;           // On the full set
+};
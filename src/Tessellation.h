@@ -0,0 +1,159 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "MeshTopology.h"
+#include "SubdivEvaluator.h"
+
+// The limit surface sampled on a fixed (u,v) grid of resolution x resolution quads per face,
+// for display and export.  A sample's position and tangents are fixed linear combinations of
+// the control vertices, so the weights are computed once per topology and resolution (see get)
+// and tessellating new control vertices is a sparse product.
+//
+// Samples on a cage edge or at a cage vertex are shared by the faces around it, and evaluated
+// once, from one of them, so neighbouring faces' quads meet exactly: the mesh has no cracks.
+struct Tessellation {
+  std::shared_ptr<SubdivTopology const> topology;
+  int resolution;
+
+  // The tessellated mesh: resolution^2 quads per cage face, face f's first.  Only quads and
+  // num_vertices are set.
+  MeshTopology mesh;
+  // Where each vertex is evaluated
+  std::vector<SurfacePoint> samples;
+  // Cage vertex x tessellation vertex, so vertex j = control_vertices * weights.col(j)
+  Eigen::SparseMatrix<Scalar> weights;
+  Eigen::SparseMatrix<Scalar> weights_u;    // For the tangents, hence normals
+  Eigen::SparseMatrix<Scalar> weights_v;
+
+  Tessellation(std::shared_ptr<SubdivTopology const> const& topology, int resolution);
+
+  // Shared and built on first use, like SubdivTopology::get.  Thread-safe.
+  static std::shared_ptr<Tessellation const> get(std::shared_ptr<SubdivTopology const> const& topology, int resolution);
+
+  // Vertices of the mesh, and optionally unit normals, for these control vertices
+  void tessellate(Matrix3X const& control_vertices, Matrix3X* vertices, Matrix3X* normals = 0) const;
+
+private:
+  int add_sample(int face, int i, int j, std::map<std::tuple<int, int, int>, int>* shared);
+};
+
+inline Tessellation::Tessellation(std::shared_ptr<SubdivTopology const> const& topology, int resolution) :
+  topology(topology),
+  resolution(resolution)
+{
+  MeshTopology const& cage = topology->mesh;
+  int R = resolution;
+  int nFaces = int(cage.num_faces());
+
+  // Number the samples, face by face, sharing those on edges and vertices
+  std::map<std::tuple<int, int, int>, int> shared;
+  std::vector<int> grid((R + 1) * (R + 1));
+  mesh.quads.resize(4, nFaces * R * R);
+  for (int face = 0; face < nFaces; ++face) {
+    for (int j = 0; j <= R; ++j)
+      for (int i = 0; i <= R; ++i)
+        grid[i + (R + 1) * j] = add_sample(face, i, j, &shared);
+    for (int j = 0; j < R; ++j)
+      for (int i = 0; i < R; ++i) {
+        int q = (face * R + j) * R + i;
+        mesh.quads(0, q) = grid[i + (R + 1) * j];
+        mesh.quads(1, q) = grid[i + 1 + (R + 1) * j];
+        mesh.quads(2, q) = grid[i + 1 + (R + 1) * (j + 1)];
+        mesh.quads(3, q) = grid[i + (R + 1) * (j + 1)];
+      }
+  }
+  mesh.num_vertices = samples.size();
+
+  // The weights don't depend on the control vertices evaluated at
+  SubdivEvaluator evaluator(topology);
+  Matrix3X X = Matrix3X::Zero(3, topology->nVertices);
+  Matrix3X S(3, samples.size());
+  SubdivEvaluator::triplets_t dSdX, dSudX, dSvdX;
+  evaluator.evaluateSubdivSurface(X, samples, &S, &dSdX, &dSudX, &dSvdX);
+
+  auto transpose = [&](SubdivEvaluator::triplets_t const& triplets, Eigen::SparseMatrix<Scalar>* out) {
+    std::vector<Eigen::Triplet<Scalar> > t;
+    t.reserve(triplets.size());
+    for (size_t k = 0; k < size_t(triplets.size()); ++k)
+      t.push_back(Eigen::Triplet<Scalar>(triplets[k].col(), triplets[k].row(), triplets[k].value()));
+    out->resize(topology->nVertices, samples.size());
+    out->setFromTriplets(t.begin(), t.end());
+  };
+  transpose(dSdX, &weights);
+  transpose(dSudX, &weights_u);
+  transpose(dSvdX, &weights_v);
+}
+
+// Sample (i, j) of face's grid, at u = i / R, v = j / R.  Face corners 0..3 are at (0,0), (1,0),
+// (1,1), (0,1), and edge k runs from corner k to corner k+1.  Shared samples are keyed by cage
+// vertex, or by edge (lower vertex first) and position along it.
+inline int Tessellation::add_sample(int face, int i, int j, std::map<std::tuple<int, int, int>, int>* shared)
+{
+  int R = resolution;
+  auto const& quads = topology->mesh.quads;
+  std::tuple<int, int, int> key;
+  bool on_boundary = true;
+  if ((i == 0 || i == R) && (j == 0 || j == R)) {
+    int corner = j == 0 ? (i == 0 ? 0 : 1) : (i == R ? 2 : 3);
+    key = std::make_tuple(quads(corner, face), -1, 0);
+  }
+  else if (j == 0 || i == R || j == R || i == 0) {
+    int edge = j == 0 ? 0 : i == R ? 1 : j == R ? 2 : 3;
+    int t = edge == 0 ? i : edge == 1 ? j : edge == 2 ? R - i : R - j;
+    int a = quads(edge, face);
+    int b = quads((edge + 1) % 4, face);
+    key = a < b ? std::make_tuple(a, b, t) : std::make_tuple(b, a, R - t);
+  }
+  else
+    on_boundary = false;
+
+  if (on_boundary) {
+    auto it = shared->find(key);
+    if (it != shared->end())
+      return it->second;
+    (*shared)[key] = int(samples.size());
+  }
+  samples.push_back({ face, { Scalar(i) / R, Scalar(j) / R } });
+  return int(samples.size()) - 1;
+}
+
+inline std::shared_ptr<Tessellation const> Tessellation::get(std::shared_ptr<SubdivTopology const> const& topology, int resolution)
+{
+  static std::mutex lock;
+  static std::map<std::pair<uint64_t, int>, std::shared_ptr<Tessellation const> > cache;
+
+  std::pair<uint64_t, int> key(topology->hash, resolution);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = cache.find(key);
+    if (it != cache.end() && it->second->topology == topology)
+      return it->second;
+  }
+  std::shared_ptr<Tessellation const> tessellation(new Tessellation(topology, resolution));
+  std::lock_guard<std::mutex> guard(lock);
+  cache[key] = tessellation;
+  return tessellation;
+}
+
+inline void Tessellation::tessellate(Matrix3X const& control_vertices, Matrix3X* vertices, Matrix3X* normals) const
+{
+  *vertices = control_vertices * weights;
+  if (!normals)
+    return;
+  Matrix3X Su = control_vertices * weights_u;
+  Matrix3X Sv = control_vertices * weights_v;
+  normals->resize(3, Su.cols());
+  for (Eigen::Index k = 0; k < Su.cols(); ++k) {
+    Vector3 n = Su.col(k).cross(Sv.col(k));
+    Scalar len = n.norm();
+    normals->col(k) = len > 0 ? Vector3(n / len) : n;
+  }
+}
@@ -0,0 +1,435 @@
+#include <cassert>
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <Eigen/Eigen>
+
+#include "eigen_extras.h"
+
+#include <unsupported/Eigen/LevenbergMarquardt>
+
+#include "MeshTopology.h"
+#include "SubdivEvaluator.h"
+#include "Tessellation.h"
+#include "Subdiv3D_Functor.h"
+#include "SubdivTracker.h"
+#include "BatchFitter.h"
+#include "SubsetFitter.h"
+#include "DeadlineFitter.h"
+#include "Downsample.h"
+#include "DistributedFitter.h"
+#include "Export.h"
+
+// Benchmarks and demos of the fitters, on the cube and points on an ellipsoid around it, as in
+// fit-subdiv-to-3d-points.cpp.  Each is run by name, e.g.
+//   Fit-Subdiv-Bench backends qr
+// and with no names they are listed.
+
+using namespace Eigen;
+
+typedef Subdiv3D_Functor Functor;
+typedef std::chrono::steady_clock clock_type;
+
+static double seconds(clock_type::time_point t0, clock_type::time_point t1)
+{
+  return std::chrono::duration<double>(t1 - t0).count();
+}
+
+// The cube, the data, and a perturbed cage with correspondences initialized, to start fits from
+struct Setup {
+  MeshTopology mesh;
+  Matrix3X control_vertices_gt;
+  int nDataPoints;
+  Matrix3X data;
+  Functor::InputType params;
+  SubdivEvaluator evaluator;
+
+  Setup(int nDataPoints) : nDataPoints(nDataPoints), data(3, nDataPoints), evaluator(make_mesh(&mesh, &control_vertices_gt))
+  {
+    for (int i = 0; i < nDataPoints; i++) {
+      Scalar t = rand() / Scalar(RAND_MAX);
+      Scalar s = rand() / Scalar(RAND_MAX);
+
+      auto u = Scalar(2 * EIGEN_PI * t);
+      auto v = Scalar(EIGEN_PI * (s - 0.5));
+      data(0, i) = 0.1f + 1.3f*cos(u)*cos(v);
+      data(1, i) = -0.2f + 0.7f*sin(u)*cos(v);
+      data(2, i) = sin(v);
+    }
+    params.control_vertices = control_vertices_gt + 0.1 * MatrixXX::Random(3, control_vertices_gt.cols());
+    params.us.resize(nDataPoints);
+    init_correspondences(evaluator, params.control_vertices, data, &params.us);
+  }
+
+  // Random points on the cage's faces
+  std::vector<SurfacePoint> random_points(int n) const
+  {
+    std::vector<SurfacePoint> us(n);
+    for (auto& u : us)
+      u = { rand() % int(mesh.num_faces()), { rand() / Scalar(RAND_MAX), rand() / Scalar(RAND_MAX) } };
+    return us;
+  }
+
+private:
+  static MeshTopology const& make_mesh(MeshTopology* mesh, Matrix3X* verts)
+  {
+    makeCube(mesh, verts);
+    return *mesh;
+  }
+};
+
+// Export: the fitted cage, its limit surface with normals, the correspondences with their
+// residuals, and the Jacobian
+static void bench_export(Setup& s)
+{
+  Functor functor(s.data, s.evaluator);
+  Eigen::LevenbergMarquardt<Functor> lm(functor);
+  lm.setMaxfev(10);
+  lm.minimize(s.params);
+
+  write_ply("cage.ply", s.mesh, s.params.control_vertices);
+  std::shared_ptr<Tessellation const> tessellation = Tessellation::get(functor.evaluator.topology, 8);
+  Matrix3X surface, normals;
+  tessellation->tessellate(s.params.control_vertices, &surface, &normals);
+  write_ply("surface.ply", tessellation->mesh, surface, &normals);
+  write_obj("surface.obj", tessellation->mesh, surface, &normals);
+
+  Functor::ValueType fvec(3 * s.nDataPoints);
+  functor(s.params, fvec);
+  write_correspondences_ply("correspondences.ply", s.data, s.params.us, &fvec);
+  Functor::JacobianType J;
+  functor.df(s.params, J);
+  write_raw("J.raw", J);
+}
+
+// Tracking: follow the data as it drifts over a few frames, warm-starting each fit from the last.
+static void bench_tracking(Setup& s)
+{
+  SubdivTracker tracker(s.mesh, s.control_vertices_gt, s.nDataPoints);
+  for (int t = 0; t < 10; ++t) {
+    Matrix3X frame = s.data;
+    frame.row(0).array() += Scalar(0.05 * t);
+    tracker.track(frame);
+    std::cerr << "Frame " << t << ": err = " << tracker.fnorm() << ", " << tracker.num_reinitialized << " points reinitialized\n";
+  }
+}
+
+// Batch: many independent fits from perturbed cages, sharing the cube's tables across threads.
+static void bench_batch(Setup& s)
+{
+  BatchFitter batch;
+  int cube = batch.add_topology(s.mesh);
+  std::vector<BatchFitter::Job> jobs(64);
+  for (auto& job : jobs) {
+    job.topology = cube;
+    job.data_points = s.data;
+    job.control_vertices = s.control_vertices_gt + 0.1 * MatrixXX::Random(3, s.control_vertices_gt.cols());
+  }
+  std::vector<BatchFitter::Result> results;
+  batch.fit(jobs, &results);
+  batch.report(results, std::cerr);
+}
+
+// Growing subsets: a few cheap iterations on samples of the points before the full fit.
+static void bench_subset(Setup& s)
+{
+  SubsetFitter subset_fitter(s.evaluator);
+  subset_fitter.initial_size = 25;
+  subset_fitter.fit(s.data, &s.params);
+  std::cerr << "Subset fit: " << subset_fitter.num_stages << " stages, err = " << subset_fitter.fnorm << "\n";
+}
+
+// Deadline: fit for 50ms, snapshot the state, and resume from the file for another 50ms.
+static void bench_deadline(Setup& s)
+{
+  Functor deadline_functor(s.data, s.evaluator);
+  deadline_functor.verbose = false;
+  DeadlineFitter deadline_fitter(deadline_functor);
+  deadline_fitter.fit(&s.params, 0.05);
+  deadline_fitter.snapshot(s.params).save("fit.snapshot");
+
+  FitSnapshot snapshot;
+  if (snapshot.load("fit.snapshot", *deadline_functor.evaluator.topology))
+    deadline_fitter.resume(snapshot, &s.params, 0.05);
+}
+
+// Downsampling: a scan 100x denser than the fit needs, binned into voxels, and fitted as the
+// voxels' means weighted by their counts
+static void bench_downsample(Setup& s)
+{
+  Matrix3X dense_data(3, 100 * s.nDataPoints);
+  for (Index i = 0; i < dense_data.cols(); ++i)
+    dense_data.col(i) = s.data.col(i % s.nDataPoints) + 0.01 * Vector3::Random();
+  Matrix3X means;
+  VectorX counts;
+  clock_type::time_point t0 = clock_type::now();
+  if (!voxel_downsample(dense_data, 0.05, &means, &counts)) {
+    std::cerr << "Downsampling: bad voxel size for the data\n";
+    return;
+  }
+  clock_type::time_point t1 = clock_type::now();
+  std::cerr << "Downsampled " << dense_data.cols() << " points to " << means.cols() << " in " << seconds(t0, t1) << "s\n";
+
+  Functor::InputType downsampled_params;
+  downsampled_params.control_vertices = s.params.control_vertices;
+  downsampled_params.us.resize(means.cols());
+  init_correspondences(s.evaluator, downsampled_params.control_vertices, means, &downsampled_params.us);
+
+  Functor downsampled_functor(means, s.evaluator);
+  downsampled_functor.point_weights = counts;
+  Eigen::LevenbergMarquardt<Functor> downsampled_lm(downsampled_functor);
+  downsampled_lm.setMaxfev(10);
+  downsampled_lm.minimize(downsampled_params);
+  std::cerr << "Downsampled fit: weighted err = " << downsampled_lm.fnorm() << "\n";
+}
+
+// Incremental evaluation: drag one control vertex, updating the surface at the correspondences
+// only on the patches it moves, and check against a full evaluation.
+static void bench_incremental(Setup& s)
+{
+  SubdivEvaluator::SurfaceCache surface;
+  s.evaluator.initSurfaceCache(s.params.control_vertices, s.params.us, &surface);
+  Matrix3X dragged = s.params.control_vertices;
+  Matrix3X S(3, s.nDataPoints);
+  for (int t = 0; t < 10; ++t) {
+    dragged.col(0) += Vector3(0.01, 0, 0);
+    size_t updated = s.evaluator.updateSurfaceCache(dragged, &surface);
+    s.evaluator.evaluateSubdivSurface(dragged, s.params.us, &S);
+    std::cerr << "Drag " << t << ": " << updated << " of " << s.nDataPoints << " points re-evaluated, err = "
+      << (S - surface.S).norm() << "\n";
+  }
+}
+
+#ifndef _WIN32
+// Distributed: the points split between 4 worker processes by region of the cage, which send
+// the coordinator only their reduced systems in the control vertices.  Its error is checked
+// against the full functor's at the result.
+static void bench_distributed(Setup& s)
+{
+  DistributedFitter distributed_fitter(s.evaluator);
+  distributed_fitter.num_workers = 4;
+  distributed_fitter.fit(s.data, &s.params);
+
+  Functor check_functor(s.data, s.evaluator);
+  Functor::ValueType fvec(3 * s.nDataPoints);
+  check_functor(s.params, fvec);
+  std::cerr << "Distributed fit: err = " << distributed_fitter.fnorm << ", single process err = " << fvec.norm() << "\n";
+}
+#endif
+
+// Allocations: after a few LM steps have grown the workspaces, count the heap allocations in the
+// functor and QR (on one thread) over the next ones, which should be none.  Needs the
+// COUNT_ALLOCATIONS build option, without which the counts stay 0.
+static void bench_allocations(Setup& s)
+{
+  Functor alloc_functor(s.data, s.evaluator);
+  alloc_functor.verbose = false;
+  alloc_functor.qr_threads = 1;
+  Eigen::LevenbergMarquardt<Functor> alloc_lm(alloc_functor);
+  alloc_lm.minimizeInit(s.params);
+  for (int i = 0; i < 3; ++i)
+    alloc_lm.minimizeOneStep(s.params);
+  alloc_functor.allocations = 0;
+  long long before = allocation_count();
+  for (int i = 0; i < 5; ++i)
+    alloc_lm.minimizeOneStep(s.params);
+  std::cerr << "Steady state: " << alloc_functor.allocations << " allocations in the functor, "
+    << allocation_count() - before << " in all\n";
+}
+
+// Active set: the same fit with and without freezing settled correspondences
+static void bench_active_set(Setup& s)
+{
+  for (int active_set = 0; active_set < 2; ++active_set) {
+    Functor::InputType x = s.params;
+    Functor functor(s.data, s.evaluator);
+    functor.use_active_set = active_set != 0;
+    Eigen::LevenbergMarquardt<Functor> lm(functor);
+    lm.setMaxfev(20);
+    clock_type::time_point t0 = clock_type::now();
+    lm.minimize(x);
+    clock_type::time_point t1 = clock_type::now();
+    std::cerr << "\n" << (active_set ? "Active set: " : "All points: ") << seconds(t0, t1) << "s, err = " << lm.fnorm()
+      << ", " << functor.num_active << " of " << s.nDataPoints << " active at the end\n";
+  }
+}
+
+// Evaluation and Jacobian throughput with points in input order vs patch order.
+static void bench_patch_order(Setup& s)
+{
+  int n = 200000;
+  std::vector<SurfacePoint> us = s.random_points(n);
+  SubdivEvaluator evaluator(s.mesh);
+  Matrix3X S(3, n), Su(3, n), Sv(3, n);
+  SubdivEvaluator::triplets_t dSdX;
+  evaluator.evaluateSubdivSurface(s.control_vertices_gt, us, &S);
+
+  Functor::InputType x;
+  x.control_vertices = s.control_vertices_gt;
+  x.us = us;
+  for (int ordered = 0; ordered < 2; ++ordered) {
+    evaluator.patch_order = ordered != 0;
+    clock_type::time_point t0 = clock_type::now();
+    evaluator.evaluateSubdivSurface(s.control_vertices_gt, us, &S, &dSdX, 0, 0, &Su, &Sv);
+    clock_type::time_point t1 = clock_type::now();
+
+    Functor f(S, evaluator);
+    f.reorder_points = ordered != 0;
+    Functor::JacobianType J;
+    f.df(x, J);
+    clock_type::time_point t2 = clock_type::now();
+
+    std::cerr << (ordered ? "Patch order: " : "Input order: ")
+      << n / seconds(t0, t1) << " evaluations/s, "
+      << n / seconds(t1, t2) << " df points/s\n";
+  }
+}
+
+// Positions, and positions with first derivatives, from each available backend, with their
+// largest difference from the native kernels'.
+static void bench_backends(Setup& s)
+{
+  int n = 1000000;
+  std::vector<SurfacePoint> us = s.random_points(n);
+  SubdivEvaluator evaluator(s.mesh);
+  Matrix3X S(3, n), Su(3, n), Sv(3, n), S_native(3, n), Su_native(3, n), Sv_native(3, n);
+  for (int b = SubdivEvaluator::BACKEND_NATIVE; b <= SubdivEvaluator::BACKEND_OSD_TBB; ++b) {
+    SubdivEvaluator::Backend backend = SubdivEvaluator::Backend(b);
+    if (!SubdivEvaluator::backend_available(backend))
+      continue;
+    evaluator.backend = backend;
+    clock_type::time_point t0 = clock_type::now();
+    evaluator.evaluateSubdivSurface(s.control_vertices_gt, us, &S);
+    clock_type::time_point t1 = clock_type::now();
+    evaluator.evaluateSubdivSurface(s.control_vertices_gt, us, &S, 0, 0, 0, &Su, &Sv);
+    clock_type::time_point t2 = clock_type::now();
+    if (backend == SubdivEvaluator::BACKEND_NATIVE) {
+      S_native = S;
+      Su_native = Su;
+      Sv_native = Sv;
+    }
+    std::cerr << SubdivEvaluator::backend_name(backend) << ": "
+      << n / seconds(t0, t1) << " S/s, "
+      << n / seconds(t1, t2) << " S,Su,Sv/s, max difference "
+      << (S - S_native).cwiseAbs().maxCoeff() << " in S, "
+      << std::max((Su - Su_native).cwiseAbs().maxCoeff(), (Sv - Sv_native).cwiseAbs().maxCoeff()) << " in Su,Sv\n";
+  }
+}
+
+// Factorization of a 1M point Jacobian by the Eigen block solver vs the closed-form 3x2 blocks.
+static void bench_qr(Setup& s)
+{
+  int n = 1000000;
+  Functor::InputType x;
+  x.control_vertices = s.control_vertices_gt;
+  x.us = s.random_points(n);
+  Matrix3X points(3, n);
+  s.evaluator.evaluateSubdivSurface(s.control_vertices_gt, x.us, &points);
+  Functor f(points + 0.01 * MatrixXX::Random(3, n), s.evaluator);
+  Functor::JacobianType J;
+  f.df(x, J);
+
+  clock_type::time_point t0 = clock_type::now();
+  Functor::SchurlikeQRSolver eigen_qr;
+  f.initQRSolver(eigen_qr);
+  eigen_qr.compute(J);
+  clock_type::time_point t1 = clock_type::now();
+  Functor::BlockQR3x2Solver block_qr;
+  f.initQRSolver(block_qr);
+  block_qr.compute(J);
+  clock_type::time_point t2 = clock_type::now();
+  std::cerr << "QR of " << n << " points: BlockDiagonalSparseQR " << seconds(t0, t1)
+    << "s, BlockQR3x2 " << seconds(t1, t2) << "s\n";
+}
+
+// Evaluation cost vs limit surface error of the isolation levels and end caps, at points near the
+// cube's corners, which are all extraordinary.  The reference is the most accurate
+// configuration, Gregory patches at isolation 8.
+static void bench_isolation(Setup& s)
+{
+  int n = 100000;
+  std::vector<SurfacePoint> us(n);
+  for (auto& u : us) {
+    Scalar a = 0.1f * rand() / Scalar(RAND_MAX), b = 0.1f * rand() / Scalar(RAND_MAX);
+    u = { rand() % int(s.mesh.num_faces()), { rand() % 2 ? a : 1 - a, rand() % 2 ? b : 1 - b } };
+  }
+  SubdivTopology::Options reference_options;
+  reference_options.isolation = 8;
+  reference_options.end_cap = SubdivTopology::ENDCAP_GREGORY;
+  Matrix3X reference(3, n), S(3, n), Su(3, n), Sv(3, n);
+  SubdivEvaluator(s.mesh, reference_options).evaluateSubdivSurface(s.control_vertices_gt, us, &reference);
+
+  for (int end_cap = SubdivTopology::ENDCAP_BSPLINE; end_cap <= SubdivTopology::ENDCAP_GREGORY; ++end_cap)
+    for (int isolation = 0; isolation <= 4; isolation += 2) {
+      SubdivTopology::Options options;
+      options.isolation = isolation;
+      options.end_cap = SubdivTopology::EndCap(end_cap);
+      SubdivEvaluator evaluator(s.mesh, options);
+      SubdivEvaluator::triplets_t dSdX;
+
+      clock_type::time_point t0 = clock_type::now();
+      evaluator.evaluateSubdivSurface(s.control_vertices_gt, us, &S, &dSdX, 0, 0, &Su, &Sv);
+      clock_type::time_point t1 = clock_type::now();
+
+      std::cerr << (end_cap == SubdivTopology::ENDCAP_BSPLINE ? "B-spline" : "Gregory") << " end caps, isolation " << isolation << ": "
+        << evaluator.topology->patch_params.size() << " patches, "
+        << n / seconds(t0, t1) << " evaluations/s, max err "
+        << (S - reference).colwise().norm().maxCoeff() << "\n";
+    }
+}
+
+struct Bench {
+  char const* name;
+  void (*run)(Setup&);
+};
+
+static const Bench benches[] = {
+  { "export", bench_export },
+  { "tracking", bench_tracking },
+  { "batch", bench_batch },
+  { "subset", bench_subset },
+  { "deadline", bench_deadline },
+  { "downsample", bench_downsample },
+  { "incremental", bench_incremental },
+#ifndef _WIN32
+  { "distributed", bench_distributed },
+#endif
+  { "allocations", bench_allocations },
+  { "active-set", bench_active_set },
+  { "patch-order", bench_patch_order },
+  { "backends", bench_backends },
+  { "qr", bench_qr },
+  { "isolation", bench_isolation },
+};
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " name...\nwhere the names are:";
+    for (Bench const& bench : benches)
+      std::cerr << " " << bench.name;
+    std::cerr << "\n";
+    return 1;
+  }
+  for (int a = 1; a < argc; ++a) {
+    Bench const* found = 0;
+    for (Bench const& bench : benches)
+      if (strcmp(bench.name, argv[a]) == 0)
+        found = &bench;
+    if (!found) {
+      std::cerr << "No benchmark " << argv[a] << "\n";
+      return 1;
+    }
+    // Each from the same start
+    srand(1);
+    Setup setup(200);
+    std::cerr << "== " << found->name << "\n";
+    found->run(setup);
+  }
+  return 0;
+}
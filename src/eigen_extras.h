@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 #include <Eigen/Eigen>
 
 typedef double Scalar;
@@ -14,6 +16,46 @@ typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> VectorX;
 typedef Eigen::Matrix<Scalar, 2, 1> Vector2;
 typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
 
+// As SparseMatrix::setFromTriplets, but filling mat's storage directly, so that once mat and
+// scratch have grown to size, refilling them (e.g. with each LM iteration's Jacobian) allocates
+// nothing.  Entries must have distinct (row, col).
+template <typename T, typename _Index, typename Triplets>
+void set_from_triplets(Eigen::SparseMatrix<T, Eigen::ColMajor, _Index>& mat, Eigen::Index rows, Eigen::Index cols,
+  Triplets const& triplets, std::vector<_Index>* scratch)
+{
+  // Bucket the entries by row, then deal them out to the columns in row order, which leaves each
+  // column's rows sorted.  scratch holds the row starts, then the entries by row.
+  size_t nnz = triplets.size();
+  scratch->assign(rows + 1 + nnz, 0);
+  _Index* row_start = scratch->data();
+  _Index* by_row = row_start + rows + 1;
+  for (auto const& t : triplets)
+    ++row_start[t.row() + 1];
+  for (Eigen::Index r = 0; r < rows; ++r)
+    row_start[r + 1] += row_start[r];
+  for (size_t k = 0; k < nnz; ++k)
+    by_row[row_start[triplets[k].row()]++] = _Index(k);
+
+  mat.resize(rows, cols);
+  mat.resizeNonZeros(Eigen::Index(nnz));
+  _Index* outer = mat.outerIndexPtr();
+  for (size_t k = 0; k < nnz; ++k)
+    ++outer[triplets[k].col() + 1];
+  for (Eigen::Index c = 0; c < cols; ++c)
+    outer[c + 1] += outer[c];
+  _Index* inner = mat.innerIndexPtr();
+  T* values = mat.valuePtr();
+  for (size_t k = 0; k < nnz; ++k) {
+    auto const& t = triplets[by_row[k]];
+    _Index pos = outer[t.col()]++;
+    inner[pos] = _Index(t.row());
+    values[pos] = t.value();
+  }
+  // The fill advanced each column's start to the next's
+  for (Eigen::Index c = cols; c > 0; --c)
+    outer[c] = outer[c - 1];
+  outer[0] = 0;
+}
 
 template <typename T, int _Options, typename _Index>
 void write(Eigen::SparseMatrix<T, _Options, _Index> const& J, char const* filename)
@@ -25,8 +67,8 @@ void write(Eigen::SparseMatrix<T, _Options, _Index> const& J, char const* filena
   }
   std::cout << "Writing " << J.rows() << "x" << J.cols() << " sparse to [" << filename << "]\n";
   for (int k = 0; k < J.outerSize(); ++k)
-    for (Eigen::SparseMatrix<T, _Options, _Index>::InnerIterator it(J, k); it; ++it)
-      f << it.row() << "\t" << it.col() << "\t" << it.value() << std::endl;
+    for (typename Eigen::SparseMatrix<T, _Options, _Index>::InnerIterator it(J, k); it; ++it)
+      f << it.row() << "\t" << it.col() << "\t" << it.value() << "\n";
 }
 
 template <typename Derived>
@@ -3,6 +3,8 @@
 #include "log3d.h"
 
 #include <iostream>
+#include <cassert>
+#include <cmath>
 
 int log3d::next_obj = 0;
 
@@ -307,6 +309,220 @@ void log3d::star(Vector3 const & X)
   lines(pts);
 }
 
+static int quantize(Scalar x, Scalar quantum)
+{
+  return int(std::floor(x / quantum + 0.5));
+}
+
+static const Scalar timeline_uv_quantum = Scalar(1.0 / 65536);
+
+void log3d::timeline_begin(Eigen::MatrixXi const& quads, size_t num_vertices, Matrix3X const& data_points, int levels, Scalar quantum)
+{
+  timeline_name = newobj("timeline");
+  timeline_quantum = quantum;
+  timeline_cv.setZero(3, num_vertices);
+  timeline_faces.setConstant(data_points.cols(), -1);
+  timeline_uvs.setZero(2, data_points.cols());
+
+  f << "var " << timeline_name << " = { material: material, levels: " << levels
+    << ", q: " << quantum << ", quv: " << timeline_uv_quantum << ", nverts: " << num_vertices << ",\n";
+  f << "  quads: [";
+  for (int face = 0; face < quads.cols(); ++face)
+    f << quads(0, face) << "," << quads(1, face) << "," << quads(2, face) << "," << quads(3, face) << ",";
+  f << "],\n";
+  f << "  data: [";
+  for (int i = 0; i < data_points.cols(); ++i)
+    f << data_points(0, i) << "," << data_points(1, i) << "," << data_points(2, i) << ",";
+  f << "],\n";
+  f << "  frames: [] };\n";
+}
+
+void log3d::timeline_frame(Matrix3X const& V, Eigen::VectorXi const& faces, Matrix2X const& uvs)
+{
+  assert(V.cols() == timeline_cv.cols());
+  assert(faces.size() == timeline_faces.size() && uvs.cols() == timeline_uvs.cols());
+
+  f << timeline_name << ".frames.push({ v: [";
+  for (int i = 0; i < V.cols(); ++i)
+    for (int k = 0; k < 3; ++k) {
+      int q = quantize(V(k, i), timeline_quantum);
+      f << q - timeline_cv(k, i) << ",";
+      timeline_cv(k, i) = q;
+    }
+
+  // Faces change rarely, so send (index, face) pairs for those that did
+  f << "], f: [";
+  for (int i = 0; i < faces.size(); ++i)
+    if (faces[i] != timeline_faces[i]) {
+      f << i << "," << faces[i] << ",";
+      timeline_faces[i] = faces[i];
+    }
+
+  f << "], u: [";
+  for (int i = 0; i < uvs.cols(); ++i)
+    for (int k = 0; k < 2; ++k) {
+      int q = quantize(uvs(k, i), timeline_uv_quantum);
+      f << q - timeline_uvs(k, i) << ",";
+      timeline_uvs(k, i) = q;
+    }
+  f << "] });\n";
+}
+
+void log3d::timeline_end()
+{
+  f << "(function (tl) {\n";
+  f << R"(
+    // Undo the delta encoding
+    var nv = tl.nverts, np = tl.data.length / 3;
+    var cv = new Int32Array(3 * nv), face = new Int32Array(np), uv = new Int32Array(2 * np);
+    var frames = [];
+    for (var t = 0; t < tl.frames.length; ++t) {
+      var fr = tl.frames[t];
+      for (var i = 0; i < fr.v.length; ++i) cv[i] += fr.v[i];
+      for (var i = 0; i < fr.f.length; i += 2) face[fr.f[i]] = fr.f[i + 1];
+      for (var i = 0; i < fr.u.length; ++i) uv[i] += fr.u[i];
+      frames.push({
+        v: Float32Array.from(cv, function (x) { return x * tl.q; }),
+        f: face.slice(),
+        u: Float32Array.from(uv, function (x) { return x * tl.quv; })
+      });
+    }
+
+    // Catmull-Clark refinement of the quad cage.  New vertices are numbered
+    // [old verts, edge points, face points], and child k of a face sits at its corner k.
+    // An edge of one face (f1 = -1) is a boundary: its edge point is its midpoint, and a vertex on
+    // two such edges takes the crease rule, 6/8 of itself and 1/8 of each neighbour along them.
+    function refineTopology(nverts, quads) {
+      var nf = quads.length / 4, edgeOf = {}, edges = [], fe = [];
+      function edge(a, b, f) {
+        var key = a < b ? a + "_" + b : b + "_" + a;
+        var e = edgeOf[key];
+        if (e === undefined) { e = edgeOf[key] = edges.length / 4; edges.push(a, b, f, -1); }
+        else edges[4 * e + 3] = f;
+        return e;
+      }
+      for (var f = 0; f < nf; ++f)
+        for (var k = 0; k < 4; ++k)
+          fe.push(edge(quads[4 * f + k], quads[4 * f + (k + 1) % 4], f));
+      var ne = edges.length / 4, child = [];
+      for (var f = 0; f < nf; ++f)
+        for (var k = 0; k < 4; ++k)
+          child.push(quads[4 * f + k], nverts + fe[4 * f + k], nverts + ne + f, nverts + fe[4 * f + (k + 3) % 4]);
+      return { nverts: nverts, quads: quads, edges: edges, child: child, next: nverts + ne + nf };
+    }
+
+    function refinePositions(lv, P) {
+      var nv = lv.nverts, nf = lv.quads.length / 4, ne = lv.edges.length / 4, fbase = nv + ne;
+      var out = new Float32Array(3 * lv.next);
+      var fsum = new Float32Array(3 * nv), esum = new Float32Array(3 * nv), valence = new Int32Array(nv);
+      var bsum = new Float32Array(3 * nv), nboundary = new Int32Array(nv);
+      for (var f = 0; f < nf; ++f)
+        for (var k = 0; k < 4; ++k)
+          for (var c = 0; c < 3; ++c)
+            out[3 * (fbase + f) + c] += 0.25 * P[3 * lv.quads[4 * f + k] + c];
+      for (var f = 0; f < nf; ++f)
+        for (var k = 0; k < 4; ++k)
+          for (var c = 0; c < 3; ++c)
+            fsum[3 * lv.quads[4 * f + k] + c] += out[3 * (fbase + f) + c];
+      for (var e = 0; e < ne; ++e) {
+        var a = lv.edges[4 * e], b = lv.edges[4 * e + 1], f0 = lv.edges[4 * e + 2], f1 = lv.edges[4 * e + 3];
+        for (var c = 0; c < 3; ++c) {
+          var mid = 0.5 * (P[3 * a + c] + P[3 * b + c]);
+          if (f1 < 0) {
+            out[3 * (nv + e) + c] = mid;
+            bsum[3 * a + c] += P[3 * b + c];
+            bsum[3 * b + c] += P[3 * a + c];
+          }
+          else
+            out[3 * (nv + e) + c] = 0.25 * (P[3 * a + c] + P[3 * b + c] + out[3 * (fbase + f0) + c] + out[3 * (fbase + f1) + c]);
+          esum[3 * a + c] += mid;
+          esum[3 * b + c] += mid;
+        }
+        valence[a]++;
+        valence[b]++;
+        if (f1 < 0) {
+          nboundary[a]++;
+          nboundary[b]++;
+        }
+      }
+      for (var v = 0; v < nv; ++v) {
+        var n = valence[v];
+        for (var c = 0; c < 3; ++c)
+          if (nboundary[v] == 2)
+            out[3 * v + c] = 0.75 * P[3 * v + c] + 0.125 * bsum[3 * v + c];
+          else if (nboundary[v] > 0)
+            out[3 * v + c] = P[3 * v + c];   // Non-manifold: leave it where it is
+          else
+            out[3 * v + c] = (fsum[3 * v + c] / n + 2 * esum[3 * v + c] / n + (n - 3) * P[3 * v + c]) / n;
+      }
+      return out;
+    }
+
+    var levels = [refineTopology(nv, tl.quads)];
+    for (var l = 1; l < tl.levels; ++l)
+      levels.push(refineTopology(levels[l - 1].next, levels[l - 1].child));
+    var quads = tl.levels > 0 ? levels[tl.levels - 1].child : tl.quads;
+    var indices = [];
+    for (var f = 0; f < quads.length; f += 4)
+      indices.push(quads[f], quads[f + 2], quads[f + 1], quads[f], quads[f + 3], quads[f + 2]);
+
+    // Follow (face, u, v) down to the refined face containing it
+    function surfacePoint(P, face, u, v) {
+      for (var l = 0; l < tl.levels; ++l) {
+        var k, u1, v1;
+        if (u <= 0.5 && v <= 0.5) { k = 0; u1 = 2 * u; v1 = 2 * v; }
+        else if (v <= 0.5) { k = 1; u1 = 2 * v; v1 = 2 * (1 - u); }
+        else if (u > 0.5) { k = 2; u1 = 2 * (1 - u); v1 = 2 * (1 - v); }
+        else { k = 3; u1 = 2 * (1 - v); v1 = 2 * u; }
+        face = 4 * face + k; u = u1; v = v1;
+      }
+      var q = quads.slice(4 * face, 4 * face + 4);
+      var w = [(1 - u) * (1 - v), u * (1 - v), u * v, (1 - u) * v];
+      var X = new BABYLON.Vector3(0, 0, 0);
+      for (var k = 0; k < 4; ++k)
+        X.addInPlace(new BABYLON.Vector3(P[3 * q[k]], P[3 * q[k] + 1], P[3 * q[k] + 2]).scale(w[k]));
+      return X;
+    }
+
+    var mesh = new BABYLON.Mesh("timeline", scene);
+    mesh.material = tl.material;
+    var corr;
+    function setFrame(t) {
+      var fr = frames[t], P = fr.v;
+      for (var l = 0; l < tl.levels; ++l)
+        P = refinePositions(levels[l], P);
+      var normals = [];
+      BABYLON.VertexData.ComputeNormals(P, indices, normals);
+      var vertexData = new BABYLON.VertexData();
+      vertexData.positions = P;
+      vertexData.indices = indices;
+      vertexData.normals = normals;
+      vertexData.applyToMesh(mesh, true);
+
+      var lines = [];
+      for (var i = 0; i < np; ++i)
+        lines.push([new BABYLON.Vector3(tl.data[3 * i], tl.data[3 * i + 1], tl.data[3 * i + 2]),
+                    surfacePoint(P, fr.f[i], fr.u[2 * i], fr.u[2 * i + 1])]);
+      corr = BABYLON.MeshBuilder.CreateLineSystem("timeline_corr", { lines: lines, updatable: true, instance: corr }, scene);
+      label.textContent = "iteration " + t + " / " + (frames.length - 1);
+    }
+
+    var slider = document.createElement("input");
+    slider.type = "range";
+    slider.min = 0;
+    slider.max = frames.length - 1;
+    slider.value = frames.length - 1;
+    slider.style.cssText = "position: absolute; left: 10px; top: 510px; width: 60%;";
+    var label = document.createElement("span");
+    label.style.cssText = "position: absolute; left: 62%; top: 510px;";
+    document.body.appendChild(slider);
+    document.body.appendChild(label);
+    slider.oninput = function () { setFrame(+slider.value); };
+    setFrame(frames.length - 1);
+)";
+  f << "})(" << timeline_name << ");\n";
+}
+
 void log3d::endcanvas() {
   f << R"(
       return scene;
@@ -37,6 +37,14 @@ struct log3d {
   void lines(Matrix3X const& V, bool closed = false);
   void star(Vector3 const & X);
 
+  // Fit timeline: a sequence of control cages and correspondences which the viewer can scrub through.
+  // Vertices are quantized to 'quantum' and (face, u, v) to 1/65536, and each frame stores only the
+  // deltas against the previous one.  The viewer refines the cage itself ('levels' Catmull-Clark steps),
+  // so recording a frame costs no evaluation here.  Call frame() any number of times between begin() and end().
+  void timeline_begin(Eigen::MatrixXi const& quads, size_t num_vertices, Matrix3X const& data_points, int levels = 3, Scalar quantum = 1e-4);
+  void timeline_frame(Matrix3X const& V, Eigen::VectorXi const& faces, Matrix2X const& uvs);
+  void timeline_end();
+
 
   // Internals
 private:
@@ -47,4 +55,11 @@ private:
   void endcanvas();
   static int next_obj;
   object_t newobj(std::string prefix);
+
+  // Timeline state: the previous frame, quantized
+  object_t timeline_name;
+  Scalar timeline_quantum;
+  Eigen::Matrix3Xi timeline_cv;
+  Eigen::VectorXi timeline_faces;
+  Eigen::Matrix2Xi timeline_uvs;
 };
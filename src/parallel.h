@@ -0,0 +1,78 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of threads to use when the caller doesn't say
+inline int default_num_threads()
+{
+  unsigned n = std::thread::hardware_concurrency();
+  return n > 0 ? int(n) : 1;
+}
+
+// Run task(i, thread) for i in [0, n) on num_threads threads, with work stealing:
+// tasks are dealt round-robin into one deque per thread, each thread works from the
+// front of its own deque and, when that runs dry, steals from the back of the others'.
+// Returns the number of steals.
+template <typename Task>
+int parallel_for_stealing(int n, int num_threads, Task task)
+{
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > n) num_threads = n > 0 ? n : 1;
+  // No queues (or allocations) needed
+  if (num_threads == 1) {
+    for (int i = 0; i < n; ++i)
+      task(i, 0);
+    return 0;
+  }
+
+  struct Queue {
+    std::mutex lock;
+    std::deque<int> tasks;
+  };
+  std::vector<Queue> queues(num_threads);
+  for (int i = 0; i < n; ++i)
+    queues[i % num_threads].tasks.push_back(i);
+
+  std::vector<int> steals(num_threads, 0);
+  auto worker = [&](int t) {
+    for (;;) {
+      int i = -1;
+      {
+        std::lock_guard<std::mutex> guard(queues[t].lock);
+        if (!queues[t].tasks.empty()) {
+          i = queues[t].tasks.front();
+          queues[t].tasks.pop_front();
+        }
+      }
+      // Nothing left here, so steal.  No tasks are added once we start, so if every
+      // queue is empty we're done.
+      for (int k = 1; i < 0 && k < num_threads; ++k) {
+        Queue& victim = queues[(t + k) % num_threads];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+          i = victim.tasks.back();
+          victim.tasks.pop_back();
+          ++steals[t];
+        }
+      }
+      if (i < 0)
+        return;
+      task(i, t);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; ++t)
+    threads.push_back(std::thread(worker, t));
+  worker(0);
+  for (auto& thread : threads)
+    thread.join();
+
+  int total = 0;
+  for (int s : steals)
+    total += s;
+  return total;
+}
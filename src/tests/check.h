@@ -0,0 +1,22 @@
+#pragma once
+
+#include <iostream>
+
+// The tests' checks: each failure is reported with its line, and main returns check_result(),
+// nonzero if any failed, for ctest.
+static int check_failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      std::cerr << __FILE__ << "(" << __LINE__ << "): CHECK FAILED [" #condition "]\n"; \
+      ++check_failures; \
+    } \
+  } while (0)
+
+inline int check_result()
+{
+  if (check_failures)
+    std::cerr << check_failures << " checks failed\n";
+  return check_failures ? 1 : 0;
+}
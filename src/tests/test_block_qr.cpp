@@ -0,0 +1,89 @@
+#include <cmath>
+
+#include <Eigen/Eigen>
+
+#include "SchurlikeQR.h"
+#include "check.h"
+
+// BlockQR3x2 against Eigen's HouseholderQR, on random 3x2 blocks and the rank deficient ones the
+// functor produces: a zero column, parallel columns, and a zero block.
+
+template <typename Scalar>
+void check_blocks(Scalar tol)
+{
+  typedef Eigen::Matrix<Scalar, 3, 2> Block;
+  typedef Eigen::Matrix<Scalar, 3, 1> Vector;
+
+  std::vector<Block> blocks;
+  for (int i = 0; i < 100; ++i)
+    blocks.push_back(Block::Random());
+  Block upper = Block::Random();
+  upper.template bottomLeftCorner<2, 1>().setZero();
+  upper(2, 1) = 0;
+  blocks.push_back(upper);
+  int first_deficient = int(blocks.size());
+  Block zero_first = Block::Random();
+  zero_first.col(0).setZero();
+  blocks.push_back(zero_first);
+  Block zero_second = Block::Random();
+  zero_second.col(1).setZero();
+  blocks.push_back(zero_second);
+  Block parallel = Block::Random();
+  parallel.col(1) = 2 * parallel.col(0);
+  blocks.push_back(parallel);
+  blocks.push_back(Block::Zero());
+
+  BlockQR3x2<Scalar> qr;
+  Eigen::Index n = Eigen::Index(blocks.size());
+  qr.resize(n);
+  for (Eigen::Index b = 0; b < n; ++b)
+    for (int k = 0; k < 6; ++k)
+      qr.a[k][b] = blocks[b](k % 3, k / 3);
+  // Full rank, then ranks 1, 1, 1, 0
+  CHECK(qr.factorize(0, n) == 2 * first_deficient + 3);
+
+  for (Eigen::Index b = 0; b < n; ++b) {
+    Block A = blocks[b];
+    if (qr.swapped[b])
+      A.col(0).swap(A.col(1));
+    Eigen::Matrix<Scalar, 2, 2> R;
+    R << qr.r00[b], qr.r01[b], 0, qr.r11[b];
+    Scalar scale = std::max(A.norm(), Scalar(1));
+
+    // Q^T A = [R; 0]
+    Block QtA = A;
+    for (int col = 0; col < 2; ++col)
+      qr.apply_qt(b, QtA(0, col), QtA(1, col), QtA(2, col));
+    CHECK((QtA.template topRows<2>() - R).norm() <= tol * scale);
+    CHECK(QtA.row(2).norm() <= tol * scale);
+
+    // Q is orthogonal
+    Vector y = Vector::Random(), Qty = y;
+    qr.apply_qt(b, Qty(0), Qty(1), Qty(2));
+    CHECK(std::abs(Qty.norm() - y.norm()) <= tol);
+
+    Eigen::HouseholderQR<Block> eigen_qr(A);
+    Eigen::Matrix<Scalar, 2, 2> eigen_R = eigen_qr.matrixQR().template topRows<2>().template triangularView<Eigen::Upper>();
+    if (b < first_deficient) {
+      // Unique up to the signs of R's rows, which are Q's
+      CHECK(!qr.deficient(b, 0) && !qr.deficient(b, 1));
+      CHECK((R.cwiseAbs() - eigen_R.cwiseAbs()).norm() <= tol * scale);
+      Vector eigen_Qty = eigen_qr.householderQ().transpose() * y;
+      CHECK((Qty.cwiseAbs() - eigen_Qty.cwiseAbs()).norm() <= tol);
+    }
+    else {
+      // R's pivots are those of the pivoted factorization, and a zero column comes second
+      CHECK(qr.deficient(b, 1));
+      CHECK(qr.deficient(b, 0) == (A.norm() == 0));
+      CHECK(std::abs(std::abs(R(0, 0)) - A.col(0).norm()) <= tol * scale);
+    }
+  }
+  CHECK(qr.swapped[first_deficient] && !qr.swapped[first_deficient + 1]);
+}
+
+int main()
+{
+  check_blocks<double>(1e-12);
+  check_blocks<float>(1e-5f);
+  return check_result();
+}
@@ -0,0 +1,82 @@
+#include <cmath>
+
+#include <Eigen/Eigen>
+
+#include <unsupported/Eigen/LevenbergMarquardt>
+
+#include "SchurlikeQR.h"
+#include "check.h"
+
+// schurlike_lmpar against Eigen's lmpar2, on a small Jacobian with the functor's structure: a
+// 3x2 block per point in its (u,v), and per point a few control vertices, dense.  Both look for
+// the par at which the step x, solving (J^T J + par D^2) x = J^T f, has |D x| within 10% of
+// delta, by the same iteration, so they should agree, to rounding, for any factorization of J.
+
+typedef Eigen::SparseMatrix<double> SparseMatrix;
+typedef Eigen::MatrixXd MatrixXd;
+typedef Eigen::VectorXd VectorXd;
+typedef SchurlikeQR<SparseMatrix, Eigen::ColPivHouseholderQR<MatrixXd> > QR;
+
+int main()
+{
+  int N = 20, V = 4, n = 2 * N + 3 * V;
+  srand(1);
+  std::vector<Eigen::Triplet<double> > entries;
+  for (int i = 0; i < N; ++i) {
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 2; ++c)
+        entries.push_back(Eigen::Triplet<double>(3 * i + r, 2 * i + c, rand() / double(RAND_MAX) - 0.5));
+    for (int k = 0; k < 3; ++k) {
+      int cv = (i + k) % V;
+      double w = rand() / double(RAND_MAX);
+      for (int r = 0; r < 3; ++r)
+        entries.push_back(Eigen::Triplet<double>(3 * i + r, 2 * N + 3 * cv + r, w));
+    }
+  }
+  SparseMatrix J(3 * N, n);
+  J.setFromTriplets(entries.begin(), entries.end());
+  J.makeCompressed();
+  MatrixXd dense_J(J);
+  VectorXd f = VectorXd::Random(3 * N);
+  VectorXd diag = dense_J.colwise().norm().transpose().cwiseMax(1.0);
+
+  Eigen::ColPivHouseholderQR<MatrixXd> dense_qr(dense_J);
+  CHECK(dense_qr.rank() == n);
+  VectorXd dense_qtb = (dense_qr.householderQ().adjoint() * f).head(n);
+
+  for (int mode = 0; mode < 2; ++mode) {
+    QR::Workspace ws;
+    QR qr;
+    qr.setBlockParams(2 * N);
+    qr.setWorkspace(&ws);
+    qr.setRightMode(mode ? QR::RIGHT_SPARSE : QR::RIGHT_DENSE);
+    qr.compute(J);
+    CHECK(qr.info() == Eigen::Success);
+    CHECK(qr.rank() == n);
+    VectorXd qtf(3 * N);
+    qr.apply_qt(f, qtf);
+    VectorXd qtb = qtf.head(n);
+
+    // From the Gauss-Newton step (par 0) down to steps well inside it
+    for (double delta : { 100.0, 1.0, 0.1, 0.01 }) {
+      for (double start : { 0.0, 1.0 }) {
+        double par = start, dense_par = start;
+        VectorXd x, dense_x;
+        schurlike_lmpar(qr, diag, qtb, delta, par, x);
+        Eigen::internal::lmpar2(dense_qr, diag, dense_qtb, delta, dense_par, dense_x);
+
+        CHECK(std::abs(par - dense_par) <= 1e-8 * std::max(dense_par, 1e-8));
+        CHECK((x - dense_x).norm() <= 1e-8 * dense_x.norm());
+
+        // x is the damped least squares step for par
+        MatrixXd A = dense_J.transpose() * dense_J;
+        A.diagonal() += par * diag.cwiseAbs2();
+        VectorXd b = dense_J.transpose() * f;
+        CHECK((A * x - b).norm() <= 1e-9 * b.norm());
+        if (par > 0)
+          CHECK(std::abs(diag.cwiseProduct(x).norm() - delta) <= 0.1 * delta);
+      }
+    }
+  }
+  return check_result();
+}
@@ -0,0 +1,129 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include <Eigen/Eigen>
+
+#include "eigen_extras.h"
+
+#include <unsupported/Eigen/LevenbergMarquardt>
+
+#include "Export.h"
+#include "check.h"
+
+// read_raw gives back what write_raw wrote, and rejects missing, truncated, padded and corrupted
+// files, leaving the matrix empty, without allocating for sizes the file can't hold.
+
+typedef Eigen::SparseMatrix<double, Eigen::ColMajor, int64_t> SparseMatrix;
+
+static std::string read_bytes(std::string const& filename)
+{
+  std::ifstream file(filename, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static void write_bytes(std::string const& filename, std::string const& bytes)
+{
+  std::ofstream file(filename, std::ios::binary);
+  file.write(bytes.data(), bytes.size());
+}
+
+// bytes with the int64 at offset replaced by value
+static std::string with_int64(std::string bytes, size_t offset, int64_t value)
+{
+  memcpy(&bytes[offset], &value, sizeof(value));
+  return bytes;
+}
+
+static char const* corrupt_filename = "test_read_raw_corrupt.raw";
+
+static bool read_dense(std::string const& bytes)
+{
+  write_bytes(corrupt_filename, bytes);
+  Eigen::MatrixXd m(2, 2);
+  bool ok = read_raw(corrupt_filename, &m);
+  CHECK(ok || m.size() == 0);
+  return ok;
+}
+
+static bool read_sparse(std::string const& bytes)
+{
+  write_bytes(corrupt_filename, bytes);
+  SparseMatrix m(2, 2);
+  bool ok = read_raw(corrupt_filename, &m);
+  CHECK(ok || (m.rows() == 0 && m.cols() == 0));
+  return ok;
+}
+
+int main()
+{
+  // Dense: magic, rows at 8, cols at 16, then the coefficients
+  Eigen::MatrixXd dense = Eigen::MatrixXd::Random(5, 3);
+  CHECK(write_raw("test_read_raw_dense.raw", dense));
+  Eigen::MatrixXd dense_read;
+  CHECK(read_raw("test_read_raw_dense.raw", &dense_read));
+  CHECK(dense_read == dense);
+  std::string bytes = read_bytes("test_read_raw_dense.raw");
+  CHECK(bytes.size() == 24 + 15 * sizeof(double));
+
+  CHECK(read_dense(bytes));
+  CHECK(!read_dense(""));
+  CHECK(!read_dense(bytes.substr(0, 20)));
+  CHECK(!read_dense(bytes.substr(0, bytes.size() - 1)));
+  CHECK(!read_dense(bytes + '\0'));
+  CHECK(!read_dense(with_int64(bytes, 8, -5)));
+  CHECK(!read_dense(with_int64(bytes, 8, 6)));
+  // rows * cols overflows to the right size
+  CHECK(!read_dense(with_int64(with_int64(bytes, 8, int64_t(1) << 62), 16, int64_t(1) << 62)));
+  CHECK(!read_dense(with_int64(bytes, 16, int64_t(1) << 61)));
+  std::string bad_magic = bytes;
+  bad_magic[7] = 'X';
+  CHECK(!read_dense(bad_magic));
+  Eigen::MatrixXd missing(2, 2);
+  CHECK(!read_raw("test_read_raw_missing.raw", &missing) && missing.size() == 0);
+
+  // Sparse: magic, rows at 8, cols at 16, nnz at 24, cols + 1 outer starts at 32, then the
+  // rows and values.  Two entries a column.
+  int64_t rows = 5, cols = 3, nnz = 6;
+  SparseMatrix sparse(rows, cols);
+  for (int64_t j = 0; j < cols; ++j) {
+    sparse.insert(j, j) = 1.0 + j;
+    sparse.insert(j + 2, j) = -2.0 - j;
+  }
+  sparse.makeCompressed();
+  CHECK(write_raw("test_read_raw_sparse.raw", sparse));
+  SparseMatrix sparse_read;
+  CHECK(read_raw("test_read_raw_sparse.raw", &sparse_read));
+  CHECK(sparse_read.rows() == rows && sparse_read.cols() == cols && sparse_read.nonZeros() == nnz);
+  CHECK(Eigen::MatrixXd(sparse_read) == Eigen::MatrixXd(sparse));
+  bytes = read_bytes("test_read_raw_sparse.raw");
+  size_t outer = 32, inner = outer + (cols + 1) * sizeof(int64_t);
+  CHECK(bytes.size() == inner + nnz * (sizeof(int64_t) + sizeof(double)));
+
+  CHECK(read_sparse(bytes));
+  CHECK(!read_dense(bytes));
+  CHECK(!read_sparse(read_bytes("test_read_raw_dense.raw")));
+  CHECK(!read_sparse(bytes.substr(0, 30)));
+  CHECK(!read_sparse(bytes.substr(0, bytes.size() - 1)));
+  CHECK(!read_sparse(bytes + '\0'));
+  CHECK(!read_sparse(with_int64(bytes, 8, -1)));
+  CHECK(!read_sparse(with_int64(bytes, 16, int64_t(1) << 62)));
+  CHECK(!read_sparse(with_int64(bytes, 24, int64_t(1) << 62)));
+  // Outer starts not from 0, decreasing, or not ending at nnz
+  CHECK(!read_sparse(with_int64(bytes, outer, 1)));
+  CHECK(!read_sparse(with_int64(bytes, outer + 8, 5)));
+  CHECK(!read_sparse(with_int64(bytes, outer + 3 * 8, 5)));
+  // Rows out of range, repeated, or out of order
+  CHECK(!read_sparse(with_int64(bytes, inner + 8, rows)));
+  CHECK(!read_sparse(with_int64(bytes, inner + 8, -1)));
+  CHECK(!read_sparse(with_int64(bytes, inner + 8, 0)));
+  CHECK(!read_sparse(with_int64(with_int64(bytes, inner, 3), inner + 8, 1)));
+  // Another row that keeps the column sorted is fine
+  CHECK(read_sparse(with_int64(bytes, inner + 8, 4)));
+
+  remove("test_read_raw_dense.raw");
+  remove("test_read_raw_sparse.raw");
+  remove(corrupt_filename);
+  return check_result();
+}
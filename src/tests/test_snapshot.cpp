@@ -0,0 +1,100 @@
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+#include <Eigen/Eigen>
+
+#include "eigen_extras.h"
+
+#include <unsupported/Eigen/LevenbergMarquardt>
+
+#include "MeshTopology.h"
+#include "DeadlineFitter.h"
+#include "check.h"
+
+// FitSnapshot round trip: save and load give back the fit state exactly, saves are byte for byte
+// repeatable, and snapshots of another topology, fit, or a damaged file are rejected.
+
+static std::string read_bytes(std::string const& filename)
+{
+  std::ifstream file(filename, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static void write_bytes(std::string const& filename, std::string const& bytes)
+{
+  std::ofstream file(filename, std::ios::binary);
+  file.write(bytes.data(), bytes.size());
+}
+
+int main()
+{
+  MeshTopology mesh;
+  Matrix3X control_vertices;
+  makeCube(&mesh, &control_vertices);
+  std::shared_ptr<SubdivTopology const> topology = SubdivTopology::get(mesh);
+
+  int n = 20;
+  FitSnapshot saved;
+  saved.params.control_vertices = control_vertices + 0.1 * MatrixXX::Random(3, control_vertices.cols());
+  saved.params.us.resize(n);
+  for (auto& u : saved.params.us)
+    u = { rand() % int(mesh.num_faces()), { rand() / Scalar(RAND_MAX), rand() / Scalar(RAND_MAX) } };
+  saved.topology_hash = topology->hash;
+  saved.diag = VectorX::Random(3 * control_vertices.cols() + 2 * n).cwiseAbs();
+  saved.external_scaling = true;
+  saved.delta = 0.25;
+  saved.par = 1e-3;
+  saved.fnorm = 1.5;
+  saved.iterations = 7;
+
+  CHECK(saved.save("test_snapshot.fitsnap"));
+  FitSnapshot loaded;
+  CHECK(loaded.load("test_snapshot.fitsnap", *topology));
+  CHECK(loaded.params.control_vertices == saved.params.control_vertices);
+  CHECK(loaded.params.us.size() == saved.params.us.size());
+  for (size_t i = 0; i < loaded.params.us.size() && i < saved.params.us.size(); ++i) {
+    CHECK(loaded.params.us[i].face == saved.params.us[i].face);
+    CHECK(loaded.params.us[i].u == saved.params.us[i].u);
+  }
+  CHECK(loaded.topology_hash == saved.topology_hash);
+  CHECK(loaded.diag == saved.diag);
+  CHECK(loaded.external_scaling == saved.external_scaling);
+  CHECK(loaded.delta == saved.delta);
+  CHECK(loaded.par == saved.par);
+  CHECK(loaded.fnorm == saved.fnorm);
+  CHECK(loaded.iterations == saved.iterations);
+
+  // The header's padding is zeroed, so a resave is identical
+  CHECK(loaded.save("test_snapshot2.fitsnap"));
+  std::string bytes = read_bytes("test_snapshot.fitsnap");
+  CHECK(!bytes.empty() && bytes == read_bytes("test_snapshot2.fitsnap"));
+
+  // Another topology of the same mesh
+  SubdivTopology::Options options;
+  options.isolation = topology->options.isolation + 1;
+  std::shared_ptr<SubdivTopology const> other_topology = SubdivTopology::get(mesh, options);
+  CHECK(!loaded.load("test_snapshot.fitsnap", *other_topology));
+
+  // Truncated, and with a bad magic number
+  write_bytes("test_snapshot_truncated.fitsnap", bytes.substr(0, bytes.size() - 1));
+  CHECK(!loaded.load("test_snapshot_truncated.fitsnap", *topology));
+  std::string bad_magic = bytes;
+  bad_magic[0] ^= 1;
+  write_bytes("test_snapshot_bad_magic.fitsnap", bad_magic);
+  CHECK(!loaded.load("test_snapshot_bad_magic.fitsnap", *topology));
+  CHECK(!loaded.load("test_snapshot_missing.fitsnap", *topology));
+
+  // resume of a fit of another number of points leaves params alone
+  Subdiv3D_Functor functor(Matrix3X::Random(3, n + 1), mesh);
+  DeadlineFitter fitter(functor);
+  Subdiv3D_Functor::InputType params;
+  CHECK(fitter.resume(saved, &params, 1) == Eigen::LevenbergMarquardtSpace::ImproperInputParameters);
+  CHECK(params.us.empty());
+
+  remove("test_snapshot.fitsnap");
+  remove("test_snapshot2.fitsnap");
+  remove("test_snapshot_truncated.fitsnap");
+  remove("test_snapshot_bad_magic.fitsnap");
+  return check_result();
+}
@@ -0,0 +1,74 @@
+#include <map>
+#include <utility>
+
+#include <Eigen/Eigen>
+
+#include "eigen_extras.h"
+
+#include <unsupported/Eigen/LevenbergMarquardt>
+
+#include "MeshTopology.h"
+#include "SubdivEvaluator.h"
+#include "Tessellation.h"
+#include "check.h"
+
+// Tessellation of the cube shares the samples on its edges and at its vertices between faces:
+// the vertex count is that of one grid per face less the shared ones, the quads close up into a
+// watertight surface, and each vertex is where every face around it puts that (u,v).
+
+int main()
+{
+  MeshTopology cube;
+  Matrix3X control_vertices;
+  makeCube(&cube, &control_vertices);
+  std::shared_ptr<SubdivTopology const> topology = SubdivTopology::get(cube);
+  SubdivEvaluator evaluator(topology);
+
+  for (int R = 1; R <= 4; ++R) {
+    Tessellation tessellation(topology, R);
+    MeshTopology const& mesh = tessellation.mesh;
+
+    // 8 cube vertices, R-1 samples inside each of 12 edges, and (R-1)^2 inside each of 6 faces
+    CHECK(mesh.num_vertices == size_t(8 + 12 * (R - 1) + 6 * (R - 1) * (R - 1)));
+    CHECK(tessellation.samples.size() == mesh.num_vertices);
+    CHECK(mesh.num_faces() == size_t(6 * R * R));
+
+    // Watertight: each quad edge is in exactly two quads
+    std::map<std::pair<int, int>, int> edges;
+    for (Eigen::Index q = 0; q < mesh.quads.cols(); ++q)
+      for (int k = 0; k < 4; ++k) {
+        int a = mesh.quads(k, q), b = mesh.quads((k + 1) % 4, q);
+        ++edges[std::make_pair(std::min(a, b), std::max(a, b))];
+      }
+    for (auto const& edge : edges)
+      CHECK(edge.second == 2);
+
+    // Each quad corner, evaluated on its own face, is at its shared vertex
+    Matrix3X vertices;
+    tessellation.tessellate(control_vertices, &vertices);
+    CHECK(vertices.cols() == Eigen::Index(mesh.num_vertices));
+    std::vector<SurfacePoint> corners;
+    std::vector<int> corner_vertices;
+    for (int face = 0; face < int(cube.num_faces()); ++face)
+      for (int j = 0; j < R; ++j)
+        for (int i = 0; i < R; ++i) {
+          int q = (face * R + j) * R + i;
+          int di[] = { 0, 1, 1, 0 }, dj[] = { 0, 0, 1, 1 };
+          for (int k = 0; k < 4; ++k) {
+            corners.push_back({ face, { Scalar(i + di[k]) / R, Scalar(j + dj[k]) / R } });
+            corner_vertices.push_back(mesh.quads(k, q));
+          }
+        }
+    Matrix3X S(3, corners.size());
+    evaluator.evaluateSubdivSurface(control_vertices, corners, &S);
+    Scalar err = 0;
+    for (size_t c = 0; c < corners.size(); ++c)
+      err = std::max(err, (S.col(c) - vertices.col(corner_vertices[c])).norm());
+    CHECK(err < 1e-5);
+  }
+
+  // get shares one per topology and resolution
+  CHECK(Tessellation::get(topology, 8) == Tessellation::get(topology, 8));
+  CHECK(Tessellation::get(topology, 8) != Tessellation::get(topology, 4));
+  return check_result();
+}